@@ -0,0 +1,239 @@
+// batch ROC evaluation over a whole dataset in one process.
+// replaces the roc.sh/sal.sh loops: every image is scored on a thread
+// pool and the per-method curves are averaged in memory, the same way
+// roc-res/process.sh averages the per-image text output.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <opencv2/highgui/highgui_c.h>
+#include <opencv2/imgproc/imgproc_c.h>
+
+#include "par.h"
+#include "sal.h"
+#include "rocstat.h"
+
+typedef struct batch_item {
+    char *gt, *in;
+    int method;
+    int ok;
+    roc_point pts[ROC_LAST+1];
+} batch_item;
+
+typedef struct batch {
+    batch_item *items;
+    int nb_items;
+    char **methods;
+    int nb_methods;
+    int sal;        // inputs are images to run saliency() on
+    int next;
+} batch;
+
+static void print_usage(char **argv)
+{
+    printf("Usage: %s [-s] <manifest> <outfile> [threads]\n"
+        "manifest lines are <method> <gt> <map>; with -s, <map> is an\n"
+        "image whose saliency map gets scored instead\n", argv[0]);
+    exit(1);
+}
+
+static IplImage *alignedImageFrom(char *file, int align)
+{
+    IplImage *pre = cvLoadImage(file, CV_LOAD_IMAGE_COLOR), *img;
+    int w, h, dx, dy, i;
+    if (!pre) return NULL;
+    w = pre->width;
+    h = pre->height;
+    dx = align - (w % align);
+    dy = align - (h % align);
+    w += (dx != align) * dx;
+    h += (dy != align) * dy;
+    CvSize s = {w, h};
+    img = cvCreateImage(s, pre->depth, pre->nChannels);
+    for (i = 0; i < pre->height; i++) {
+        memcpy(img->imageData + i*img->widthStep,
+            pre->imageData + i*pre->widthStep, pre->widthStep);
+    }
+    cvReleaseImage(&pre);
+    return img;
+}
+
+// 8-bit score map, as sal would have written it out
+static IplImage *salmap8(char *file)
+{
+    IplImage *img = alignedImageFrom(file, 8), *sal, *out;
+    sal_opts opts;
+    if (!img) return NULL;
+    // the images already keep every cpu busy
+    memset(&opts, 0, sizeof(sal_opts));
+    opts.nb_threads = 1;
+    sal = saliency_opts(img, &opts);
+    out = cvCreateImage(cvGetSize(sal), IPL_DEPTH_8U, 1);
+    cvConvertScale(sal, out, 255, 0);
+    cvReleaseImage(&sal);
+    cvReleaseImage(&img);
+    return out;
+}
+
+static int method_id(batch *b, char *name)
+{
+    int i;
+    for (i = 0; i < b->nb_methods; i++) {
+        if (!strcmp(b->methods[i], name)) return i;
+    }
+    b->methods = realloc(b->methods, (i+1)*sizeof(char*));
+    b->methods[i] = strdup(name);
+    b->nb_methods++;
+    return i;
+}
+
+static void read_manifest(batch *b, char *path)
+{
+    char line[3072], method[1024], gt[1024], in[1024];
+    int cap = 0, lineno = 0;
+    batch_item *it;
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "batch: unable to open %s\n", path);
+        exit(1);
+    }
+    while (fgets(line, sizeof(line), f)) {
+        lineno++;
+        if (line[0] == '#' || line[0] == '\n') continue;
+        if (sscanf(line, "%1023s %1023s %1023s", method, gt, in) != 3) {
+            fprintf(stderr, "batch: %s:%d: expected <method> <gt> <map>\n",
+                path, lineno);
+            exit(1);
+        }
+        if (b->nb_items == cap) {
+            cap = cap ? cap*2 : 64;
+            b->items = realloc(b->items, cap*sizeof(batch_item));
+        }
+        it = &b->items[b->nb_items++];
+        it->gt = strdup(gt);
+        it->in = strdup(in);
+        it->method = method_id(b, method);
+        it->ok = 0;
+    }
+    fclose(f);
+}
+
+static void eval_item(batch *b, batch_item *it)
+{
+    roc_stat r;
+    IplImage *gt = cvLoadImage(it->gt, CV_LOAD_IMAGE_GRAYSCALE), *map;
+    if (!gt) {
+        fprintf(stderr, "batch: unable to load %s\n", it->gt);
+        return;
+    }
+    if (b->sal) map = salmap8(it->in);
+    else map = cvLoadImage(it->in, CV_LOAD_IMAGE_GRAYSCALE);
+    if (!map) {
+        fprintf(stderr, "batch: unable to load %s\n", it->in);
+        cvReleaseImage(&gt);
+        return;
+    }
+    roc_stat_new(&r, map, gt);
+    roc_stat_points(&r, it->pts);
+    it->ok = 1;
+    cvReleaseImage(&map);
+    cvReleaseImage(&gt);
+}
+
+static void batch_thr(void *arg, int id)
+{
+    batch *b = (batch*)arg;
+    int i;
+    (void)id;
+    while ((i = __atomic_fetch_add(&b->next, 1, __ATOMIC_RELAXED)) <
+        b->nb_items) eval_item(b, &b->items[i]);
+}
+
+// Mean of each ratio over the images of a method, per threshold; an
+// image where a ratio is undefined (nothing detected, say) is left out
+// of that mean. The auc is over the mean (fpr, recall) curve.
+static void write_method(FILE *f, batch *b, int m)
+{
+    double prec[ROC_LAST+1], rec[ROC_LAST+1], fpr[ROC_LAST+1];
+    int np[ROC_LAST+1], nr[ROC_LAST+1], nf[ROC_LAST+1];
+    int i, t, n = 0;
+    double auc = 0, px = 1, py = 1;
+    memset(prec, 0, sizeof(prec));
+    memset(rec, 0, sizeof(rec));
+    memset(fpr, 0, sizeof(fpr));
+    memset(np, 0, sizeof(np));
+    memset(nr, 0, sizeof(nr));
+    memset(nf, 0, sizeof(nf));
+    for (i = 0; i < b->nb_items; i++) {
+        batch_item *it = &b->items[i];
+        if (it->method != m || !it->ok) continue;
+        n++;
+        for (t = ROC_FIRST; t <= ROC_LAST; t++) {
+            roc_point *p = &it->pts[t];
+            if (p->tp + p->fp) {
+                prec[t] += p->tp/(double)(p->tp + p->fp);
+                np[t]++;
+            }
+            if (p->tp + p->fn) {
+                rec[t] += p->tp/(double)(p->tp + p->fn);
+                nr[t]++;
+            }
+            if (p->fp + p->tn) {
+                fpr[t] += p->fp/(double)(p->fp + p->tn);
+                nf[t]++;
+            }
+        }
+    }
+    for (t = ROC_FIRST; t <= ROC_LAST; t++) {
+        prec[t] = np[t] ? prec[t]/np[t] : NAN;
+        rec[t] = nr[t] ? rec[t]/nr[t] : NAN;
+        fpr[t] = nf[t] ? fpr[t]/nf[t] : NAN;
+        if (isnan(rec[t]) || isnan(fpr[t])) continue;
+        // thresholds rise, so the curve runs from (1,1) down to (0,0)
+        auc += (px - fpr[t])*(py + rec[t])/2;
+        px = fpr[t];
+        py = rec[t];
+    }
+    auc += px*py/2;
+    fprintf(f, "method %s images %d auc %f\n", b->methods[m], n, auc);
+    for (t = ROC_FIRST; t <= ROC_LAST; t++) {
+        fprintf(f, "%d %f %f %f\n", t, prec[t], rec[t], fpr[t]);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    batch b;
+    FILE *f;
+    int i, nb_threads = 0, arg = 1;
+    memset(&b, 0, sizeof(batch));
+    if (argc > 1 && !strcmp(argv[1], "-s")) {
+        b.sal = 1;
+        arg++;
+    }
+    if (argc - arg < 2) print_usage(argv);
+    if (argc - arg > 2) nb_threads = atoi(argv[arg+2]);
+    read_manifest(&b, argv[arg]);
+    f = fopen(argv[arg+1], "w");
+    if (!f) {
+        fprintf(stderr, "batch: unable to open %s\n", argv[arg+1]);
+        exit(1);
+    }
+
+    par_run(nb_threads, batch_thr, &b);
+
+    fprintf(f, "# batch: %s %d items\n", argv[arg], b.nb_items);
+    for (i = 0; i < b.nb_methods; i++) write_method(f, &b, i);
+    fclose(f);
+
+    for (i = 0; i < b.nb_items; i++) {
+        free(b.items[i].gt);
+        free(b.items[i].in);
+    }
+    for (i = 0; i < b.nb_methods; i++) free(b.methods[i]);
+    free(b.items);
+    free(b.methods);
+    return 0;
+}
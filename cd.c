@@ -1,6 +1,7 @@
 // processing changedetection.net dataset
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <pthread.h>
 
 #include <opencv2/imgproc/imgproc_c.h>
@@ -11,6 +12,10 @@
 #include "wht.h"
 #include "sal.h"
 #include "gck.h"
+#include "recon.h"
+#include "par.h"
+#include "prefetch.h"
+#include "writer.h"
 
 #define XY_TO_INT(x, y) (((y) << 16) | (x))
 #define XY_TO_X(x) ((x)&((1<<16)-1))
@@ -28,16 +33,15 @@ static inline double get_time()
 
 static void print_usage(char **argv)
 {
-    printf("Usage: %s <path> <start> <end> <bkg_name> <diff_name>\n",
-        argv[0]);
+    printf("Usage: %s <path> <start> <end> <bkg_name> <diff_name> "
+        "[outdir|out.msk|out.raw] [threads]\n", argv[0]);
     exit(1);
 }
 
-static char fname[1024];
-static char* mkname(char *path, int i)
+static char* mkname(char *buf, int len, char *path, int i)
 {
-    snprintf(fname, sizeof(fname), "%s/in%06d.jpg", path, i);
-    return fname;
+    snprintf(buf, len, "%s/in%06d.jpg", path, i);
+    return buf;
 }
 
 static int bitrev(unsigned int n, unsigned int bits)
@@ -220,53 +224,6 @@ static IplImage* splat(int *coeffs, CvSize size, int *plane_coeffs)
     return img;
 }
 
-static void xy2blks_special(IplImage *xy, IplImage *src, IplImage *recon, int kernsz)
-{
-    int w = xy->width - 7, h = xy->height - 7, i, j;
-    int xystride = xy->widthStep/sizeof(int32_t);
-    int rstride = recon->widthStep;
-    int stride = src->widthStep;
-    int32_t *xydata = (int32_t*)xy->imageData;
-    uint8_t *rdata = (uint8_t*)recon->imageData;
-    uint8_t *data = (uint8_t*)src->imageData;
-    for (i = 0; i < h; i++) {
-        for (j = 0; j < w; j++) {
-            int v = xydata[i*xystride + j], k;
-            int x = XY_TO_X(v), y = XY_TO_Y(v);
-            for (k = 0; k < kernsz*kernsz; k++) {
-                int xoff = k % kernsz, yoff = k / kernsz;
-                int rd = (i*kernsz + yoff)*rstride + (j*kernsz + xoff)*3;
-                int dd = (y + yoff)*stride + (x + xoff)*3;
-                *(rdata + rd + 0) = *(data + dd + 0);
-                *(rdata + rd + 1) = *(data + dd + 1);
-                *(rdata + rd + 2) = *(data + dd + 2);
-            }
-        }
-    }
-}
-
-static void xy2img(IplImage *xy, IplImage *img, IplImage *recon)
-{
-    int w = xy->width, h = xy->height, i, j;
-    int xystride = xy->widthStep/sizeof(int32_t);
-    int rstride = recon->widthStep;
-    int stride = img->widthStep;
-    int32_t *xydata = (int32_t*)xy->imageData;
-    uint8_t *rdata = (uint8_t*)recon->imageData;
-    uint8_t *data = (uint8_t*)img->imageData;
-
-    for (i = 0; i < h; i++) {
-        for (j = 0; j < w; j++) {
-            int v = xydata[i*xystride + j];
-            int x = XY_TO_X(v), y = XY_TO_Y(v);
-            int rd = i*rstride + j*3, dd = y*stride + x*3;
-            *(rdata + rd + 0) = *(data + dd + 0);
-            *(rdata + rd + 1) = *(data + dd + 1);
-            *(rdata + rd + 2) = *(data + dd + 2);
-        }
-    }
-}
-
 static IplImage *alignedImage(CvSize dim, int depth, int chan, int align)
 {
     int w = dim.width, h = dim.height;
@@ -277,16 +234,18 @@ static IplImage *alignedImage(CvSize dim, int depth, int chan, int align)
     return cvCreateImage(s, depth, chan);
 }
 
-int orig_w = -1, orig_h = -1;
-static IplImage *alignedImageFrom(char *file, int align)
+static IplImage *alignedImageFrom(char *file, int align, CvSize *orig)
 {
     IplImage *pre = cvLoadImage(file, CV_LOAD_IMAGE_COLOR);
+    if (!pre) {
+        fprintf(stderr, "cd: unable to load %s\n", file);
+        exit(1);
+    }
     IplImage *img = alignedImage(cvGetSize(pre), pre->depth, pre->nChannels, align);
     char *pre_data = pre->imageData;
     char *img_data = img->imageData;
     int i;
-    orig_w = pre->width;
-    orig_h = pre->height;
+    if (orig) *orig = cvGetSize(pre);
     for (i = 0; i < pre->height; i++) {
         memcpy(img_data, pre_data, pre->widthStep);
         img_data += img->widthStep;
@@ -297,65 +256,72 @@ static IplImage *alignedImageFrom(char *file, int align)
 }
 
 static int plane_coeffs[] = {2, 9, 5};
-IplImage *recon_g, *diff_g, *lap_g, *gray_g, *mask_g, *bkg_g;
-static void init_g(IplImage *bkg)
+// Per worker scratch. The background, its tree and the difference
+// image are shared read-only.
+typedef struct cd_ctx {
+    IplImage *recon, *diff, *gray, *mask;
+    prop_field xy;
+    CvSize orig; // frame size before alignment
+} cd_ctx;
+
+static void ctx_init(cd_ctx *ctx, IplImage *bkg)
 {
     CvSize bsz = cvGetSize(bkg);
-    recon_g = cvCreateImage(bsz, bkg->depth, bkg->nChannels);
-    diff_g  = cvCreateImage(bsz, bkg->depth, bkg->nChannels);
-    bkg_g   = cvCreateImage(bsz, bkg->depth, bkg->nChannels);
-    gray_g  = cvCreateImage(bsz, bkg->depth, 1);
-    mask_g  = cvCreateImage(bsz, bkg->depth, 1);
-    lap_g   = cvCreateImage(bsz, IPL_DEPTH_32F, bkg->nChannels);
+    CvSize blksz = {(bsz.width/8)+7, (bsz.height/8)+7};
+    ctx->recon = cvCreateImage(bsz, bkg->depth, bkg->nChannels);
+    ctx->diff  = cvCreateImage(bsz, bkg->depth, bkg->nChannels);
+    ctx->gray  = cvCreateImage(bsz, bkg->depth, 1);
+    ctx->mask  = cvCreateImage(bsz, bkg->depth, 1);
+    prop_field_new(&ctx->xy, blksz, bsz, 0);
+    ctx->orig = bsz;
 }
 
-static void free_g()
+static void ctx_free(cd_ctx *ctx)
 {
-    cvReleaseImage(&recon_g);
-    cvReleaseImage(&diff_g);
-    cvReleaseImage(&gray_g);
-    cvReleaseImage(&mask_g);
-    cvReleaseImage(&lap_g);
-    cvReleaseImage(&bkg_g);
+    cvReleaseImage(&ctx->recon);
+    cvReleaseImage(&ctx->diff);
+    cvReleaseImage(&ctx->gray);
+    cvReleaseImage(&ctx->mask);
+    prop_field_free(&ctx->xy);
 }
 
-static void process(kd_tree *kdt, IplImage *bkg, IplImage *diff,
-    IplImage *img, char *outname)
+// Leaves the change mask for img in ctx->mask.
+static void process(cd_ctx *ctx, kd_tree *kdt, IplImage *bkg,
+    IplImage *diff, IplImage *img)
 {
+    // frames are already spread over every cpu
+    prop_opts opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.nb_threads = 1;
     //int *imgc = block_coeffs(img, plane_coeffs);
-    cvAbsDiff(img, bkg, diff_g);
-    int *imgc = block_coeffs(diff_g, plane_coeffs);
-    CvSize blksz = {(img->width/8)+7, (img->height/8)+7};
-    IplImage *xy = prop_match_complete(kdt, imgc, bkg, blksz);
+    cvAbsDiff(img, bkg, ctx->diff);
+    int *imgc = block_coeffs(ctx->diff, plane_coeffs);
+    prop_match_field(kdt, imgc, bkg, &ctx->xy, &opts);
     IplImage *rev = splat(imgc, cvGetSize(img), plane_coeffs);
-    xy2blks_special(xy, diff, recon_g, 8);
-    cvAbsDiff(rev, recon_g, diff_g);
+    recon_field_blks(&ctx->xy, diff, ctx->recon, 8);
+    cvAbsDiff(rev, ctx->recon, ctx->diff);
     cvReleaseImage(&rev);
     /*int *imgc;
     prop_coeffs(diff_g, plane_coeffs, &imgc);
     CvSize blksz = cvGetSize(bkg);
     IplImage *xy = prop_match_complete(kdt, imgc, bkg, blksz);
-    xy2img(xy, diff, recon_g);
+    recon_xy(xy, diff, recon_g);
     cvAbsDiff(diff_g, recon_g, diff_g);*/
     //cvShowImage("diff_g before mul", diff_g);
     //cvAbsDiff(diff_g, diff, diff_g);
     //cvMul(diff_g, idiff, diff_g, 1);
-    cvCvtColor(diff_g, gray_g, CV_BGR2GRAY);
+    cvCvtColor(ctx->diff, ctx->gray, CV_BGR2GRAY);
 
     // full pixel dc
     //IplImage *dc = make_dc(gray_g);
-    IplImage *mask = cvCreateImage(cvGetSize(img), IPL_DEPTH_8U, 1);
+    IplImage *mask = ctx->mask;
     IplImage *dc_f = cvCreateImage(cvGetSize(img), IPL_DEPTH_32F, 1);
-    int *graydc = gck_calc_2d((uint8_t*)gray_g->imageData, img->width, img->height, KERNS, 1);
+    int *graydc = gck_calc_2d((uint8_t*)ctx->gray->imageData, img->width, img->height, KERNS, 1);
     IplImage *dc = cvCreateImageHeader(cvGetSize(img), IPL_DEPTH_32S, 1);
     int step = img->width + KERNS - 1;
     cvSetData(dc, graydc, step*sizeof(int));
     cvConvertScale(dc, dc_f, 1/255.0, 0);
-    cvThreshold(gray_g, mask, 25, 255.0, CV_THRESH_BINARY);
-
-    mask->width = orig_w;
-    mask->height = orig_h;
-    if (*outname) cvSaveImage(outname, mask, 0);
+    cvThreshold(ctx->gray, mask, 25, 255.0, CV_THRESH_BINARY);
 
     /*double min = 0, max = 0;
     cvMinMaxLoc(dc, &min, &max, NULL, NULL, NULL);
@@ -371,7 +337,7 @@ static void process(kd_tree *kdt, IplImage *bkg, IplImage *diff,
     //cvSmooth(diff_g, diff_g, CV_GAUSSIAN, 5, 5, 0, 0);
     //cvLaplace(diff_g, lap_g, 3);
     //IplImage *xy = prop_match(bkg, img);
-    //xy2img(xy, bkg, recon_g);
+    //recon_xy(xy, bkg, recon_g);
     //cvAbsDiff(recon_g, img, diff_g);
     /*cvShowImage("recon", recon_g);
     //cvShowImage("diff", rev);
@@ -382,10 +348,8 @@ static void process(kd_tree *kdt, IplImage *bkg, IplImage *diff,
     cvShowImage("mask", mask);
     cvShowImage("dc", dc);*/
     free(imgc);
-    cvReleaseImage(&xy);
     cvReleaseImageHeader(&dc);
     free(graydc);
-    cvReleaseImage(&mask);
     cvReleaseImage(&dc_f);
 }
 
@@ -413,54 +377,64 @@ static void test(IplImage *b)
     return;
 }
 
-typedef struct thread_ctx {
-    int start;
-    int end;
-    int nb;
-    char *path;
-    char *outfile;
-    IplImage *bkg;
-    IplImage *diff;
-    kd_tree *kdt;
-} thread_ctx;
+// Frames are dealt round-robin to the workers. Masks reach the writer
+// strictly in frame order: a worker holds on to its mask until every
+// earlier frame has been handed over.
+#define CD_DECODERS 2
 
-static void* run_thr(void *arg)
+typedef struct cd_job {
+    prefetch *pf;
+    writer *wr; // NULL to discard the masks
+    kd_tree *kdt;
+    IplImage *bkg, *diff;
+    int start, end, nb;
+    pthread_mutex_t lock;
+    pthread_cond_t turn;
+    int next;   // next frame to be written
+    double t;   // processing time, summed over workers
+} cd_job;
+
+static void run_thr(void *arg, int id)
 {
-    thread_ctx *ctx = (thread_ctx*)arg;
-    double t = 0;
-    int i, start = ctx->start, end = ctx->end, nb = ctx->nb;
-    char outname[1024], *path = ctx->path, *outfile = ctx->outfile;
-    memset(outname, '\0', sizeof(outname));
-    printf("starting thread %d\n", start);
-    for (i = start; i <= end; i+= nb) {
-        IplImage *img = alignedImageFrom(mkname(path, i), 8);
-        double start = get_time();
-        if (outfile) snprintf(outname, sizeof(outname), "%s/bin%06d.png", outfile, i);
-        process(ctx->kdt, ctx->bkg, ctx->diff, img, outname);
-        t += (get_time() - start);
-        if ((cvWaitKey(1)&255)==27)break; // esc
-        cvReleaseImage(&img);
+    cd_job *job = (cd_job*)arg;
+    cd_ctx ctx;
+    int i;
+    ctx_init(&ctx, job->bkg);
+    for (i = job->start + id; i <= job->end; i += job->nb) {
+        IplImage *img = prefetch_get(job->pf, i, &ctx.orig);
+        double start = get_time(), t;
+        process(&ctx, job->kdt, job->bkg, job->diff, img);
+        t = get_time() - start;
+        prefetch_release(job->pf, i);
+
+        pthread_mutex_lock(&job->lock);
+        while (job->next != i) pthread_cond_wait(&job->turn, &job->lock);
+        pthread_mutex_unlock(&job->lock);
+        if (job->wr) ctx.mask = writer_put(job->wr, ctx.mask, ctx.orig, i);
+        pthread_mutex_lock(&job->lock);
+        job->next++;
+        job->t += t;
+        pthread_cond_broadcast(&job->turn);
+        pthread_mutex_unlock(&job->lock);
     }
-    printf("avg: %fms\n", t/(i-start)*1000);
-    return NULL;
+    ctx_free(&ctx);
 }
 
 int main(int argc, char **argv)
 {
     if (argc < 6) print_usage(argv);
     char *path = argv[1];
-    int start = atoi(argv[2]), end = atoi(argv[3]), i, *bkgc;
+    int start = atoi(argv[2]), end = atoi(argv[3]), *bkgc;
     //IplImage *bkg = alignedImageFrom(mkname(path, 1), 8);
-    IplImage *bkg = alignedImageFrom(argv[4], 8);
+    IplImage *bkg = alignedImageFrom(argv[4], 8, NULL);
     int dim = plane_coeffs[0] + plane_coeffs[1] + plane_coeffs[2];
     CvSize bsz = cvGetSize(bkg);
-    IplImage *d8 = alignedImageFrom(argv[5], 8);
+    IplImage *d8 = alignedImageFrom(argv[5], 8, NULL);
     //IplImage *d8 = alignedImageFrom(mkname(path, 1), 8);
     int w = bsz.width - 8 + 1, h = bsz.height - 8 + 1, sz = w*h;
     kd_tree kdt;
 
     printf("cd: %s %d %d %s %s\n", path, start, end, argv[4], argv[5]);
-    init_g(bkg);
     memset(&kdt, 0, sizeof(kd_tree));
 
     /*
@@ -500,40 +474,42 @@ int main(int argc, char **argv)
     prop_coeffs(bkg, plane_coeffs, &bkgc);
     kdt_new(&kdt, bkgc, sz, dim);
 
-    /*thread_ctx ctxs[3];
-    pthread_t thrs[sizeof(ctxs)/sizeof(thread_ctx)];
-    for (i = 0; i < (int)(sizeof(ctxs)/sizeof(thread_ctx)); i++) {
-        thread_ctx *ctx = &ctxs[i];
-        ctx->start = i+1;
-        ctx->end = end;
-        ctx->nb = sizeof(ctxs)/sizeof(thread_ctx);
-        ctx->path = path;
-        ctx->outfile = argc >= 7 ? argv[6] : NULL;
-        ctx->bkg = bkg;
-        ctx->diff = d8;
-        ctx->kdt = &kdt;
-        pthread_create(&thrs[i], NULL, run_thr, ctx);
+    cd_job job;
+    prefetch pf;
+    writer wr;
+    job.pf = &pf;
+    job.wr = NULL;
+    job.kdt = &kdt;
+    job.bkg = bkg;
+    job.diff = d8;
+    job.start = job.next = start;
+    job.end = end;
+    job.nb = par_threads(argc >= 8 ? atoi(argv[7]) : 0);
+    if (job.nb > end - start + 1) job.nb = end - start + 1;
+    if (job.nb < 1) job.nb = 1;
+    job.t = 0;
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.turn, NULL);
+    // a couple of frames of slack per worker keeps the decoders ahead
+    prefetch_new(&pf, mkname, path, start, end, 8, CD_DECODERS, 2*job.nb);
+    if (argc >= 7) {
+        char *out = argv[6], *ext = strrchr(out, '.');
+        int mode = WRITER_PNG;
+        if (ext && !strcmp(ext, ".raw")) mode = WRITER_RAW;
+        if (ext && !strcmp(ext, ".msk")) mode = WRITER_RLE;
+        writer_new(&wr, out, mode, 2*job.nb);
+        job.wr = &wr;
     }
-    for (i = 0; i < (int)(sizeof(ctxs)/sizeof(thread_ctx)); i++) {
-        pthread_join(thrs[i], NULL);
+    par_run(job.nb, run_thr, &job);
+    prefetch_free(&pf);
+    if (job.wr) writer_free(job.wr);
+    pthread_mutex_destroy(&job.lock);
+    pthread_cond_destroy(&job.turn);
+    if (job.next > start) {
+        printf("%d threads, avg: %fms\n", job.nb,
+            job.t/(job.next - start)*1000);
     }
-    printf("all done!\n");*/
 
-    double t;
-    char outname[1024];
-    memset(outname, '\0', sizeof(outname));
-    for (i = start; i <= end; i++) {
-        IplImage *img = alignedImageFrom(mkname(path, i), 8);
-        double start = get_time();
-        if (argc >= 7) snprintf(outname, sizeof(outname), "%s/bin%06d.png", argv[6], i);
-        //process(&kdt, bkg, d8, img, outname);
-        //test(img);
-        cvShowImage("image", img);
-        t += (get_time() - start);
-        if ((cvWaitKey(1)&255)==27)break; // esc
-        cvReleaseImage(&img);
-    }
-    //free_g();
     kdt_free(&kdt);
     free(bkgc);
     cvReleaseImage(&bkg);
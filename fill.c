@@ -4,6 +4,8 @@
 #include <opencv2/highgui/highgui_c.h>
 #include <opencv2/imgproc/imgproc_c.h>
 
+#include "recon.h"
+
 #define PATCH_W 7
 #define PM_ITERS 5
 #define RS_MAX INT_MAX
@@ -229,7 +231,6 @@ static void normalize(IplImage *a, IplImage *acc, IplImage *mask)
     }
 }
 
-void xy2img(IplImage *xy, IplImage *img, IplImage *recon);
 static IplImage* fill(IplImage *a, IplImage *target, IplImage *mask)
 {
 
@@ -276,7 +277,7 @@ static IplImage* fill(IplImage *a, IplImage *target, IplImage *mask)
     for (i= 0; i< PM_ITERS; i++) { 
         // completeness term
         patchmatch(a, target, ann, annd, imask);
-        xy2img(ann, target, d);
+        recon_xy(ann, target, d);
         cvShowImage("completeness", d);
         for (ay = 0; ay < aeh; ay++) {
             for (ax = 0; ax < aew; ax++) {
@@ -290,7 +291,7 @@ static IplImage* fill(IplImage *a, IplImage *target, IplImage *mask)
 
         // coherence term
         patchmatch(target, a, ann, annd, mask);
-        xy2img(ann, a, d);
+        recon_xy(ann, a, d);
         cvShowImage("coherence", d);
         for (ay = 0; ay < aeh; ay++) {
             for (ax = 0; ax < aew; ax++) {
@@ -317,28 +318,6 @@ static IplImage* fill(IplImage *a, IplImage *target, IplImage *mask)
     return target;
 }
 
-void xy2img(IplImage *xy, IplImage *img, IplImage *recon)
-{
-    int w = xy->width, h = xy->height, i, j;
-    int xystride = xy->widthStep/sizeof(int32_t);
-    int rstride = recon->widthStep;
-    int stride = img->widthStep;
-    int32_t *xydata = (int32_t*)xy->imageData;
-    uint8_t *rdata = (uint8_t*)recon->imageData;
-    uint8_t *data = (uint8_t*)img->imageData;
-
-    for (i = 0; i < h; i++) {
-        for (j = 0; j < w; j++) {
-            int v = xydata[i*xystride + j];
-            int x = XY_TO_X(v), y = XY_TO_Y(v);
-            int rd = i*rstride + j*3, dd = y*stride + x*3;
-            *(rdata + rd + 0) = *(data + dd + 0);
-            *(rdata + rd + 1) = *(data + dd + 1);
-            *(rdata + rd + 2) = *(data + dd + 2);
-        }
-    }
-}
-
 static IplImage* make_mask(char *fname)
 {
     IplImage *img = cvLoadImage(fname, CV_LOAD_IMAGE_COLOR);
@@ -0,0 +1,145 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <opencv2/imgproc/imgproc_c.h>
+
+#include "ftsal.h"
+
+// sRGB D65 to XYZ in Q12, X and Z divided by the white point, as
+// cvCvtColor(CV_BGR2Lab) does; columns are B, G, R.
+static const int ft_xyz[3][3] = {
+    {778, 1541, 1777},  // X
+    {296, 2929, 871},   // Y
+    {3575, 448, 73},    // Z
+};
+
+void ft_sal_new(ft_sal *s)
+{
+    int i;
+    memset(s, 0, sizeof(ft_sal));
+    for (i = 0; i < 256; i++) {
+        double x = i/255.0;
+        x = x <= 0.04045 ? x/12.92 : pow((x + 0.055)/1.055, 2.4);
+        s->lin[i] = x*32768 + 0.5;
+    }
+    for (i = 0; i <= 32768; i++) {
+        double t = i/32768.0;
+        t = t > 0.008856 ? cbrt(t) : 7.787*t + 16/116.0;
+        s->f[i] = t*4096 + 0.5;
+    }
+}
+
+void ft_sal_free(ft_sal *s)
+{
+    free(s->lab);
+    free(s->row);
+    memset(s, 0, sizeof(ft_sal));
+}
+
+static int ft_clip(int v)
+{
+    return v < 0 ? 0 : v > 32768 ? 32768 : v;
+}
+
+// Lab of every pixel into three planes, and their sums.
+static void ft_lab(ft_sal *s, IplImage *img, int64_t *sum)
+{
+    int w = img->width, h = img->height, sz = w*h, x, y;
+    int16_t *L = s->lab, *A = L + sz, *B = A + sz;
+    for (y = 0; y < h; y++) {
+        uint8_t *p = (uint8_t*)img->imageData + y*img->widthStep;
+        int64_t sl = 0, sa = 0, sb = 0;
+        for (x = 0; x < w; x++, p += 3) {
+            int b = s->lin[p[0]], g = s->lin[p[1]], r = s->lin[p[2]];
+            int fx = s->f[ft_clip((ft_xyz[0][0]*b + ft_xyz[0][1]*g +
+                ft_xyz[0][2]*r + 2048) >> 12)];
+            int fy = s->f[ft_clip((ft_xyz[1][0]*b + ft_xyz[1][1]*g +
+                ft_xyz[1][2]*r + 2048) >> 12)];
+            int fz = s->f[ft_clip((ft_xyz[2][0]*b + ft_xyz[2][1]*g +
+                ft_xyz[2][2]*r + 2048) >> 12)];
+            int i = y*w + x;
+            // 116f - 16, 500(fx - fy), 200(fy - fz); f is Q12, out Q4
+            L[i] = (1856*fy - 256*4096 + 2048) >> 12;
+            A[i] = (8000*(fx - fy) + 2048) >> 12;
+            B[i] = (3200*(fy - fz) + 2048) >> 12;
+            sl += L[i];
+            sa += A[i];
+            sb += B[i];
+        }
+        sum[0] += sl;
+        sum[1] += sa;
+        sum[2] += sb;
+    }
+}
+
+// reflected without repeating the edge, like cvSmooth
+static int ft_reflect(int i, int n)
+{
+    if (n == 1) return 0;
+    while (i < 0 || i >= n) i = i < 0 ? -i : 2*n - 2 - i;
+    return i;
+}
+
+IplImage *ft_saliency(ft_sal *s, IplImage *img)
+{
+    static const int k[5] = {1, 4, 6, 4, 1};
+    int w = img->width, h = img->height, sz = w*h, x, y, c, i;
+    int64_t sum[3] = {0, 0, 0};
+    int mean[3];
+    IplImage *out;
+
+    if (img->depth != IPL_DEPTH_8U || img->nChannels != 3) {
+        fprintf(stderr, "ftsal: expected an 8-bit BGR image\n");
+        return NULL;
+    }
+    if (w != s->w || h != s->h) {
+        free(s->lab);
+        free(s->row);
+        s->lab = malloc(3*sz*sizeof(int16_t));
+        s->row = malloc(3*(w + 4)*sizeof(int32_t));
+        s->w = w;
+        s->h = h;
+        if (!s->lab || !s->row) {
+            fprintf(stderr, "ftsal: unable to allocate buffers\n");
+            exit(1);
+        }
+    }
+    ft_lab(s, img, sum);
+    // blurred values are Q12 (Q4 times the 256 of the two passes)
+    for (c = 0; c < 3; c++) mean[c] = (sum[c]*256 + sz/2)/sz;
+
+    out = cvCreateImage(cvGetSize(img), IPL_DEPTH_32F, 1);
+    for (y = 0; y < h; y++) {
+        int rows[5];
+        float *o = (float*)(out->imageData + y*out->widthStep);
+        for (i = 0; i < 5; i++) rows[i] = ft_reflect(y + i - 2, h)*w;
+        // vertical pass, with two reflected columns each side
+        for (c = 0; c < 3; c++) {
+            int16_t *p = s->lab + c*sz;
+            int32_t *r = s->row + c*(w + 4) + 2;
+            for (x = 0; x < w; x++) {
+                r[x] = p[rows[0]+x] + 4*p[rows[1]+x] + 6*p[rows[2]+x] +
+                    4*p[rows[3]+x] + p[rows[4]+x];
+            }
+            for (i = 1; i <= 2; i++) {
+                r[-i] = r[ft_reflect(-i, w)];
+                r[w-1+i] = r[ft_reflect(w-1+i, w)];
+            }
+        }
+        // horizontal pass and the distance to the mean, back in Q4
+        for (x = 0; x < w; x++) {
+            int d2 = 0;
+            for (c = 0; c < 3; c++) {
+                int32_t *r = s->row + c*(w + 4) + 2 + x;
+                int v = k[0]*r[-2] + k[1]*r[-1] + k[2]*r[0] + k[3]*r[1] +
+                    k[4]*r[2];
+                int d = (v - mean[c] + 128) >> 8;
+                d2 += d*d;
+            }
+            o[x] = d2*(1/256.0f);
+        }
+    }
+    return out;
+}
@@ -0,0 +1,24 @@
+#ifndef JOSH_FTSAL_H
+#define JOSH_FTSAL_H
+
+#include <stdint.h>
+
+// Frequency-tuned saliency, after Achanta et al.: the squared Lab
+// distance of each pixel, blurred 5x5, to the mean Lab of the image.
+// Fixed point throughout; Lab is kept in 1/16ths. Buffers are reused
+// from one call to the next while the size stays the same.
+
+typedef struct ft_sal {
+    uint16_t lin[256];      // sRGB to linear, Q15
+    uint16_t f[32769];      // Lab f(t) for t in Q15, Q12
+    int16_t *lab;           // three planes of the image
+    int32_t *row;           // vertical blur of one row, three planes
+    int w, h;
+} ft_sal;
+
+void ft_sal_new(ft_sal *s);
+// img is 8-bit BGR; returns a float map of squared Lab distances.
+IplImage *ft_saliency(ft_sal *s, IplImage *img);
+void ft_sal_free(ft_sal *s);
+
+#endif /* JOSH_FTSAL_H */
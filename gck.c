@@ -226,11 +226,12 @@ static int gck_direction(GCKPoint *p1, GCKPoint *p2)
     return 1;
 }
 
-int* gck_calc_2d(uint8_t *data, int w, int h, int kern_size, int bases)
+// res holds (w+kern_size-1)*(h+kern_size-1)*bases ints; every one of
+// them is overwritten so it need not be cleared between calls.
+int gck_calc_2d_into(uint8_t *data, int w, int h, int kern_size, int bases,
+    int *res)
 {
     int i, wh = (w+kern_size - 1) * (h + kern_size - 1);
-    int size = wh * bases;
-    int *res = calloc(size, sizeof(int)); // TODO cacheline padding?
     GCKPoint adj, *path = malloc(bases * sizeof(GCKPoint));
     gck_path(path, kern_size, bases);
     //print_path(path, bases);
@@ -239,7 +240,10 @@ int* gck_calc_2d(uint8_t *data, int w, int h, int kern_size, int bases)
     for (i = 1; i < bases; i++) {
         gck_get_adj(&path[i], &adj);
         int j = gck_adj_idx(&path[i], &adj, i);
-        if (-1 == j) return NULL;
+        if (-1 == j) {
+            free(path);
+            return -1;
+        }
         int horiz = gck_direction(&path[i], &adj);
         int *prev = res + j * wh;
         int *cur = res + i * wh;
@@ -248,6 +252,18 @@ int* gck_calc_2d(uint8_t *data, int w, int h, int kern_size, int bases)
     }
 
     free(path);
+    return 0;
+}
+
+int* gck_calc_2d(uint8_t *data, int w, int h, int kern_size, int bases)
+{
+    int wh = (w+kern_size - 1) * (h + kern_size - 1);
+    int size = wh * bases;
+    int *res = calloc(size, sizeof(int)); // TODO cacheline padding?
+    if (gck_calc_2d_into(data, w, h, kern_size, bases, res)) {
+        free(res);
+        return NULL;
+    }
     return res;
 }
 
@@ -2,6 +2,8 @@
 #define JOSH_GCK_H
 
 int* gck_calc_2d(uint8_t *data, int w, int h, int kern_size, int bases);
+int gck_calc_2d_into(uint8_t *data, int w, int h, int kern_size, int bases,
+    int *res);
 int *gck_alloc_buffer(int w, int h, int kern_size, int bases);
 
 #endif
@@ -4,32 +4,7 @@
 #include <opencv2/highgui/highgui_c.h>
 
 #include "prop.h"
-
-#define XY_TO_X(x) ((x)&((1<<16)-1))
-#define XY_TO_Y(y) ((y)>>16)
-static void xy2img(IplImage *xy, IplImage *img, IplImage *recon)
-{
-    int w = xy->width, h = xy->height, i, j;
-    int xystride = xy->widthStep/sizeof(int32_t);
-    int rstride = recon->widthStep;
-    int stride = img->widthStep;
-    int32_t *xydata = (int32_t*)xy->imageData;
-    uint8_t *rdata = (uint8_t*)recon->imageData;
-    uint8_t *data = (uint8_t*)img->imageData;
-
-    for (i = 0; i < h; i++) {
-        for (j = 0; j < w; j++) {
-            int v = xydata[i*xystride + j];
-            int x = XY_TO_X(v), y = XY_TO_Y(v);
-            int rd = i*rstride + j*3, dd = y*stride + x*3;
-            *(rdata + rd + 0) = *(data + dd + 0);
-            *(rdata + rd + 1) = *(data + dd + 1);
-            *(rdata + rd + 2) = *(data + dd + 2);
-        }
-    }
-}
-#undef XY_TO_X
-#undef XY_TO_Y
+#include "recon.h"
 
 static IplImage *alignedImage(CvSize dim, int depth, int chan, int align)
 {
@@ -84,57 +59,61 @@ int main(int argc, char **argv)
 {
     double start, end;
 #define SAMEAS(q) cvCreateImage(cvGetSize((q)), (q)->depth, (q)->nChannels)
-    char *s, *d, *g;
+    char *s, *d, *g, *defaults[] = {"gt", "lena.png", "eva.jpg", "eva-gt.png"};
+    int i;
     if (argc < 4) {
-        s = "lena.png";
-        d = "eva.jpg";
-        g = "eva-gt.png";
-    } else {
-        s = argv[1];
-        d = argv[2];
-        g = argv[3];
+        argv = defaults;
+        argc = 4;
     }
-    printf("gt: \"%s\" \"%s\" \"%s\"\n", s, d, g);
+    s = argv[1];
     IplImage *src = alignedImageFrom(s, 8);
-    IplImage *dst = alignedImageFrom(d, 8);
-    IplImage *gt = alignedImageFrom(g, 8);
-    IplImage *diff = SAMEAS(dst);
-    IplImage *gtdiff = SAMEAS(dst);
-    IplImage *diff2 = SAMEAS(dst);
-    IplImage *diff3 = SAMEAS(dst);
-    IplImage *match = SAMEAS(dst);
-    start = get_time();
-    IplImage *xy = prop_match(src, dst);
-    xy2img(xy, src, match);
-    end = get_time();
-    cvAbsDiff(match, gt, diff);
-    cvAbsDiff(gt, dst, gtdiff);
-    cvAbsDiff(match, dst, diff2);
-    cvAbsDiff(gtdiff, diff2, diff3);
-    /*cvNamedWindow("match-gt", CV_WINDOW_NORMAL);
-    cvNamedWindow("gt", CV_WINDOW_NORMAL);
-    cvNamedWindow("match", CV_WINDOW_NORMAL);
-    cvResizeWindow("match-gt", 960, 400);
-    cvResizeWindow("gt", 960, 400);
-    cvResizeWindow("match", 960, 400);*/
-    //cvShowImage("gt", gt);
-    //cvShowImage("match-dst", diff2);
-    //cvShowImage("match-gt", diff);
-    //cvShowImage("gt-dst" , gtdiff);
-    //cvShowImage("match", match);
-    //cvShowImage("gtdiff - matchdiff", diff3);
-    printf("elapsed %f\n", (end-start)*1000);
-    printf("match-gt %lld\n", sumimg(diff, 8));
-    //cvWaitKey(0);
+    prop_matcher m;
+    prop_matcher_new(&m, src, NULL);
+    // any further dst/gt pairs reuse the source tree
+    for (i = 2; i + 1 < argc; i += 2) {
+        d = argv[i];
+        g = argv[i + 1];
+        printf("gt: \"%s\" \"%s\" \"%s\"\n", s, d, g);
+        IplImage *dst = alignedImageFrom(d, 8);
+        IplImage *gt = alignedImageFrom(g, 8);
+        IplImage *diff = SAMEAS(dst);
+        IplImage *gtdiff = SAMEAS(dst);
+        IplImage *diff2 = SAMEAS(dst);
+        IplImage *diff3 = SAMEAS(dst);
+        IplImage *match = SAMEAS(dst);
+        start = get_time();
+        prop_field *f = prop_matcher_match(&m, dst);
+        cvSetZero(match);
+        recon_field(f, src, match);
+        end = get_time();
+        cvAbsDiff(match, gt, diff);
+        cvAbsDiff(gt, dst, gtdiff);
+        cvAbsDiff(match, dst, diff2);
+        cvAbsDiff(gtdiff, diff2, diff3);
+        /*cvNamedWindow("match-gt", CV_WINDOW_NORMAL);
+        cvNamedWindow("gt", CV_WINDOW_NORMAL);
+        cvNamedWindow("match", CV_WINDOW_NORMAL);
+        cvResizeWindow("match-gt", 960, 400);
+        cvResizeWindow("gt", 960, 400);
+        cvResizeWindow("match", 960, 400);*/
+        //cvShowImage("gt", gt);
+        //cvShowImage("match-dst", diff2);
+        //cvShowImage("match-gt", diff);
+        //cvShowImage("gt-dst" , gtdiff);
+        //cvShowImage("match", match);
+        //cvShowImage("gtdiff - matchdiff", diff3);
+        printf("elapsed %f\n", (end-start)*1000);
+        printf("match-gt %lld\n", sumimg(diff, 8));
+        //cvWaitKey(0);
+        cvReleaseImage(&dst);
+        cvReleaseImage(&diff);
+        cvReleaseImage(&diff2);
+        cvReleaseImage(&diff3);
+        cvReleaseImage(&gtdiff);
+        cvReleaseImage(&match);
+        cvReleaseImage(&gt);
+    }
+    prop_matcher_free(&m);
     cvReleaseImage(&src);
-    cvReleaseImage(&dst);
-    cvReleaseImage(&diff);
-    cvReleaseImage(&diff2);
-    cvReleaseImage(&gtdiff);
-    cvReleaseImage(&match);
-    cvReleaseImage(&gt);
-    cvReleaseImage(&xy);
-    return 0;
-    return 0;
     return 0;
 }
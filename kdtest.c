@@ -10,6 +10,7 @@
 #include "wht.h"
 #include "kdtree.h"
 #include "prop.h"
+#include "recon.h"
 
 #define XY_TO_INT(x, y) (((y) << 16) | (x))
 #define XY_TO_X(x) ((x)&((1<<16)-1))
@@ -641,30 +642,6 @@ static int64_t sumimg(IplImage *img, int kern)
     return sum;
 }
 
-#define XY_TO_X(x) ((x)&((1<<16)-1))
-#define XY_TO_Y(y) ((y)>>16)
-static void xy2img(IplImage *xy, IplImage *img, IplImage *recon)
-{
-    int w = xy->width, h = xy->height, i, j;
-    int xystride = xy->widthStep/sizeof(int32_t);
-    int rstride = recon->widthStep;
-    int stride = img->widthStep;
-    int32_t *xydata = (int32_t*)xy->imageData;
-    uint8_t *rdata = (uint8_t*)recon->imageData;
-    uint8_t *data = (uint8_t*)img->imageData;
-
-    for (i = 0; i < h; i++) {
-        for (j = 0; j < w; j++) {
-            int v = xydata[i*xystride + j];
-            int x = XY_TO_X(v), y = XY_TO_Y(v);
-            int rd = i*rstride + j*3, dd = y*stride + x*3;
-            *(rdata + rd + 0) = *(data + dd + 0);
-            *(rdata + rd + 1) = *(data + dd + 1);
-            *(rdata + rd + 2) = *(data + dd + 2);
-        }
-    }
-}
-
 static void test_complete()
 {
     //IplImage *dst = alignedImageFrom("frames/bbb22.png", 8);
@@ -693,8 +670,10 @@ static void test_complete()
     kdt_new(&kdt, i, sz, dim);
     t4 = get_time();
 
-    IplImage *xy = prop_match_complete(&kdt, di, src, dst_size);
-    xy2img(xy, src, matched);
+    prop_field xy;
+    prop_field_new(&xy, dst_size, src_size, 0);
+    prop_match_field(&kdt, di, src, &xy, NULL);
+    recon_field(&xy, src, matched);
     t5 = get_time();
     IplImage *matched3 = match_complete3(&kdt, di, src, dst_size);
     IplImage *matched2 = match_complete2(&kdt, di, src, dst_size);
@@ -723,7 +702,7 @@ static void test_complete()
     free(di);
     cvReleaseImage(&src);
     cvReleaseImage(&dst);
-    cvReleaseImage(&xy);
+    prop_field_free(&xy);
     cvReleaseImage(&matched);
     cvReleaseImage(&matched2);
     cvReleaseImage(&matched3);
@@ -732,57 +711,6 @@ static void test_complete()
     cvReleaseImage(&diff3);
 }
 
-static void xy2blks_special(IplImage *xy, IplImage *src, IplImage *recon, int kernsz)
-{
-    int w = xy->width - 7, h = xy->height - 7, i, j;
-    int xystride = xy->widthStep/sizeof(int32_t);
-    int rstride = recon->widthStep;
-    int stride = src->widthStep;
-    int32_t *xydata = (int32_t*)xy->imageData;
-    uint8_t *rdata = (uint8_t*)recon->imageData;
-    uint8_t *data = (uint8_t*)src->imageData;
-    for (i = 0; i < h; i++) {
-        for (j = 0; j < w; j++) {
-            int v = xydata[i*xystride + j], k;
-            int x = XY_TO_X(v), y = XY_TO_Y(v);
-            for (k = 0; k < kernsz*kernsz; k++) {
-                int xoff = k % kernsz, yoff = k / kernsz;
-                int rd = (i*kernsz + yoff)*rstride + (j*kernsz + xoff)*3;
-                int dd = (y + yoff)*stride + (x + xoff)*3;
-                *(rdata + rd + 0) = *(data + dd + 0);
-                *(rdata + rd + 1) = *(data + dd + 1);
-                *(rdata + rd + 2) = *(data + dd + 2);
-            }
-        }
-    }
-}
-static void xy2blks(IplImage *xy, IplImage *src, IplImage *recon, int kernsz)
-{
-    int w = xy->width, h = xy->height, i, j;
-    int xystride = xy->widthStep/sizeof(int32_t);
-    int rstride = recon->widthStep;
-    int stride = src->widthStep;
-    int32_t *xydata = (int32_t*)xy->imageData;
-    uint8_t *rdata = (uint8_t*)recon->imageData;
-    uint8_t *data = (uint8_t*)src->imageData;
-    for (i = 0; i < h; i++) {
-        for (j = 0; j < w; j++) {
-            int v = xydata[i*xystride + j], k;
-            int x = XY_TO_X(v), y = XY_TO_Y(v);
-            for (k = 0; k < kernsz*kernsz; k++) {
-                int xoff = k % kernsz, yoff = k / kernsz;
-                int rd = (i*kernsz + yoff)*rstride + (j*kernsz + xoff)*3;
-                int dd = (y + yoff)*stride + (x + xoff)*3;
-                *(rdata + rd + 0) = *(data + dd + 0);
-                *(rdata + rd + 1) = *(data + dd + 1);
-                *(rdata + rd + 2) = *(data + dd + 2);
-            }
-        }
-    }
-}
-#undef XY_TO_X
-#undef XY_TO_Y
-
 static int64_t match_score(int *coeffs, kd_node *n, int k)
 {
     int i, j, *u, *v, **p = n->value, best = INT_MAX, idx = -1;
@@ -872,10 +800,12 @@ static void test_gck3()
     dsti = block_coeffs(dst, plane_coeffs);
     memset(&kdt, 0, sizeof(kdt));
     kdt_new(&kdt, srci, sz, dim);
-    IplImage *xy = prop_match_complete(&kdt, dsti, src, dst_blks);
-    xy2blks_special(xy, src, recon, 8);
+    prop_field xy;
+    prop_field_new(&xy, dst_blks, ssz, 0);
+    prop_match_field(&kdt, dsti, src, &xy, NULL);
+    recon_field_blks(&xy, src, recon, 8);
     IplImage *xy2 = match4(&kdt, dsti, ssz, dsz);
-    xy2blks(xy2, src, recon2, 8);
+    recon_xy_blks(xy2, src, recon2, 8);
     cvAbsDiff(recon, dst, diff);
     cvAbsDiff(recon2, dst, diff2);
     cvShowImage("prop", recon);
@@ -883,7 +813,7 @@ static void test_gck3()
     printf("prop: %lld\nmatch4: %lld\n",
         sumimg(diff, 8), sumimg(diff2, 8));
     cvWaitKey(0);
-    cvReleaseImage(&xy);
+    prop_field_free(&xy);
     cvReleaseImage(&xy2);
     free(srci);
     free(dsti);
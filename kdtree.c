@@ -191,6 +191,7 @@ void kdt_new_overlap(kd_tree *t, int *points, int nb_points, int k, float overla
         t->points[j++] = points + i*k;
     }
     nb_points = j - 1;
+    t->nb_points = nb_points;
     t->nodes = malloc(nb_points*sizeof(kd_node));
     t->nb_nodes = 0;
     t->start = points;
@@ -207,6 +208,7 @@ void kdt_new(kd_tree *t, int *points, int nb_points, int k)
     t->map = malloc(nb_points*sizeof(kd_node*));
     t->nodes = malloc(nb_points*sizeof(kd_node));
     for (i = 0; i < nb_points; i++) t->points[i] = points+i*k;
+    t->nb_points = nb_points;
     t->nb_nodes = 0;
     t->start = points;
     t->end = points + nb_points * k;
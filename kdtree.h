@@ -14,6 +14,7 @@ typedef struct kd_tree {
     int k, nb_nodes;
     int *order;
     int **points;
+    int nb_points;  // entries of points in the tree
     int *start;
     int *end;
     kd_node *root;
@@ -0,0 +1,280 @@
+// Run-length coded mask container.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "maskfile.h"
+
+#define MASK_MAGIC "JMSKFILE"
+#define MASK_VERSION 1
+#define HEADER_SIZE 40
+#define ENTRY_SIZE 16
+#define MAX_PIXELS (1 << 28) // a frame's size has to fit its 32 bit length
+
+#define ERR(msg) { fprintf(stderr, "maskfile: %s\n", msg); return -1; }
+
+static void put32(uint8_t *b, uint32_t v)
+{
+    b[0] = v; b[1] = v >> 8; b[2] = v >> 16; b[3] = v >> 24;
+}
+
+static void put64(uint8_t *b, uint64_t v)
+{
+    put32(b, v);
+    put32(b + 4, v >> 32);
+}
+
+static uint32_t get32(uint8_t *b)
+{
+    return b[0] | b[1] << 8 | b[2] << 16 | (uint32_t)b[3] << 24;
+}
+
+static uint64_t get64(uint8_t *b)
+{
+    return get32(b) | (uint64_t)get32(b + 4) << 32;
+}
+
+static void header(maskfile *m, uint64_t index_off, uint8_t *b)
+{
+    memcpy(b, MASK_MAGIC, 8);
+    put32(b + 8, MASK_VERSION);
+    put32(b + 12, m->codec);
+    put32(b + 16, m->w);
+    put32(b + 20, m->h);
+    put32(b + 24, m->nb);
+    put32(b + 28, 0);
+    put64(b + 32, index_off);
+}
+
+static uint8_t *put_run(uint8_t *o, uint32_t run)
+{
+    while (run >= 0x80) {
+        *o++ = run | 0x80;
+        run >>= 7;
+    }
+    *o++ = run;
+    return o;
+}
+
+// A varint is never longer than the run it codes, so the output fits
+// in w*h + 1 bytes.
+static int rle_encode(uint8_t *data, int w, int h, int stride, uint8_t *o)
+{
+    uint8_t *start = o;
+    uint32_t run = 0;
+    int on = 0, x, y;
+    for (y = 0; y < h; y++) {
+        uint8_t *d = data + y*stride;
+        for (x = 0; x < w; x++) {
+            // skip through whole words of the current value
+            if (!(x & 7) && x + 8 <= w) {
+                uint64_t v;
+                memcpy(&v, d + x, 8);
+                if (v == (on ? ~(uint64_t)0 : 0)) {
+                    run += 8;
+                    x += 7;
+                    continue;
+                }
+            }
+            if (!d[x] != !on) {
+                o = put_run(o, run);
+                on = !on;
+                run = 0;
+            }
+            run++;
+        }
+    }
+    o = put_run(o, run);
+    return o - start;
+}
+
+static int rle_decode(uint8_t *in, int len, int w, int h, uint8_t *out,
+    int stride)
+{
+    uint8_t *end = in + len;
+    int on = 0, x = 0, y = 0;
+    while (in < end && y < h) {
+        uint32_t run = 0;
+        int shift = 0;
+        do {
+            if (shift >= 32) ERR("bad run length");
+            run |= (uint32_t)(*in & 0x7f) << shift;
+            shift += 7;
+        } while (*in++ & 0x80 && in < end);
+        while (run && y < h) {
+            int n = (int)run < w - x ? (int)run : w - x;
+            memset(out + y*stride + x, on ? 255 : 0, n);
+            run -= n;
+            x += n;
+            if (x == w) {
+                x = 0;
+                y++;
+            }
+        }
+        on = !on;
+    }
+    if (y < h) ERR("truncated frame");
+    return 0;
+}
+
+int maskfile_create(maskfile *m, char *name, int w, int h, int codec)
+{
+    uint8_t b[HEADER_SIZE];
+    memset(m, 0, sizeof(*m));
+    m->w = w;
+    m->h = h;
+    m->codec = codec;
+    m->f = fopen(name, "wb");
+    if (!m->f) ERR("unable to create file");
+    m->buf = malloc((size_t)w*h + 1);
+    // index offset 0 marks the file unfinished until maskfile_close
+    header(m, 0, b);
+    if (!m->buf || fwrite(b, 1, HEADER_SIZE, m->f) != HEADER_SIZE) {
+        fclose(m->f);
+        free(m->buf);
+        memset(m, 0, sizeof(*m));
+        ERR("unable to start file");
+    }
+    m->pos = HEADER_SIZE;
+    return 0;
+}
+
+int maskfile_append(maskfile *m, int frame, uint8_t *data, int stride)
+{
+    maskfile_entry *e;
+    int len, y;
+    if (!m->f) ERR("not open for writing");
+    if (m->nb == m->cap) {
+        m->cap = m->cap ? 2*m->cap : 256;
+        m->index = realloc(m->index, m->cap*sizeof(maskfile_entry));
+        if (!m->index) ERR("unable to allocate index");
+    }
+    if (m->codec == MASK_RLE) {
+        len = rle_encode(data, m->w, m->h, stride, m->buf);
+        if (fwrite(m->buf, 1, len, m->f) != (size_t)len) ERR("write failed");
+    } else {
+        for (y = 0; y < m->h; y++) {
+            if (fwrite(data + y*stride, 1, m->w, m->f) != (size_t)m->w)
+                ERR("write failed");
+        }
+        len = m->w*m->h;
+    }
+    e = &m->index[m->nb++];
+    e->frame = frame;
+    e->len = len;
+    e->off = m->pos;
+    m->pos += len;
+    return 0;
+}
+
+int maskfile_find(maskfile *m, int frame)
+{
+    int lo = 0, hi = m->nb - 1, i;
+    // frames are usually appended in order; fall back to a scan
+    while (lo <= hi) {
+        int mid = (lo + hi)/2;
+        if (m->index[mid].frame == frame) return mid;
+        if (m->index[mid].frame < frame) lo = mid + 1;
+        else hi = mid - 1;
+    }
+    for (i = 0; i < m->nb; i++) if (m->index[i].frame == frame) return i;
+    return -1;
+}
+
+int maskfile_read(maskfile *m, int i, uint8_t *out, int stride)
+{
+    maskfile_entry *e;
+    uint8_t *d;
+    int y;
+    if (!m->map) ERR("not open for reading");
+    if (i < 0 || i >= m->nb) ERR("no such entry");
+    e = &m->index[i];
+    d = m->map + e->off;
+    if (m->codec == MASK_RLE) return rle_decode(d, e->len, m->w, m->h, out, stride);
+    if (e->len < (uint32_t)(m->w*m->h)) ERR("truncated frame");
+    for (y = 0; y < m->h; y++) memcpy(out + y*stride, d + y*m->w, m->w);
+    return 0;
+}
+
+int maskfile_open(maskfile *m, char *name)
+{
+    struct stat st;
+    uint64_t index_off;
+    int fd, i;
+    memset(m, 0, sizeof(*m));
+    fd = open(name, O_RDONLY);
+    if (fd < 0) ERR("unable to open file");
+    if (fstat(fd, &st) || st.st_size < HEADER_SIZE) {
+        close(fd);
+        ERR("not a mask file");
+    }
+    m->map_size = st.st_size;
+    m->map = mmap(NULL, m->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (MAP_FAILED == m->map) {
+        m->map = NULL;
+        ERR("unable to map file");
+    }
+    if (memcmp(m->map, MASK_MAGIC, 8) || get32(m->map + 8) != MASK_VERSION) {
+        maskfile_close(m);
+        ERR("not a mask file");
+    }
+    m->codec = get32(m->map + 12);
+    m->w = get32(m->map + 16);
+    m->h = get32(m->map + 20);
+    m->nb = get32(m->map + 24);
+    if (m->w <= 0 || m->h <= 0 || (uint64_t)m->w*m->h > MAX_PIXELS) {
+        maskfile_close(m);
+        ERR("bad frame size");
+    }
+    index_off = get64(m->map + 32);
+    if (index_off < HEADER_SIZE ||
+        index_off + (uint64_t)m->nb*ENTRY_SIZE > m->map_size) {
+        maskfile_close(m);
+        ERR("truncated index; was the writer closed?");
+    }
+    m->index = malloc((m->nb ? m->nb : 1)*sizeof(maskfile_entry));
+    for (i = 0; i < m->nb; i++) {
+        uint8_t *b = m->map + index_off + i*ENTRY_SIZE;
+        m->index[i].frame = get32(b);
+        m->index[i].len = get32(b + 4);
+        m->index[i].off = get64(b + 8);
+        if (m->index[i].off + m->index[i].len > index_off) {
+            maskfile_close(m);
+            ERR("bad index entry");
+        }
+    }
+    return 0;
+}
+
+int maskfile_close(maskfile *m)
+{
+    int i, ret = 0;
+    if (m->f) {
+        uint8_t b[HEADER_SIZE];
+        for (i = 0; i < m->nb; i++) {
+            maskfile_entry *e = &m->index[i];
+            put32(b, e->frame);
+            put32(b + 4, e->len);
+            put64(b + 8, e->off);
+            if (fwrite(b, 1, ENTRY_SIZE, m->f) != ENTRY_SIZE) ret = -1;
+        }
+        header(m, m->pos, b);
+        if (fseek(m->f, 0, SEEK_SET) ||
+            fwrite(b, 1, HEADER_SIZE, m->f) != HEADER_SIZE) ret = -1;
+        if (fclose(m->f)) ret = -1;
+        if (ret) fprintf(stderr, "maskfile: error finishing file\n");
+    }
+    if (m->map) munmap(m->map, m->map_size);
+    free(m->index);
+    free(m->buf);
+    memset(m, 0, sizeof(*m));
+    return ret;
+}
+#undef ERR
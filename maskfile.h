@@ -0,0 +1,49 @@
+#ifndef JOSH_MASKFILE_H
+#define JOSH_MASKFILE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+// Multi-frame container for 8 bit masks, all of one size.
+//   header: "JMSKFILE", then int32 version, codec, width, height,
+//           nb_frames, reserved, and the int64 offset of the index
+//   frames: back to back, each encoded with the file's codec
+//   index:  per frame int32 frame number, uint32 length, uint64 offset
+// Everything little endian. MASK_RLE stores alternating runs of zero
+// and non-zero pixels as LEB128 varints, starting with a (possibly
+// empty) zero run; decoding gives 0 and 255. MASK_RAW stores the
+// bytes as they are.
+
+enum { MASK_RAW, MASK_RLE };
+
+typedef struct maskfile_entry {
+    int32_t frame;
+    uint32_t len;
+    uint64_t off;
+} maskfile_entry;
+
+typedef struct maskfile {
+    int w, h, codec, nb;
+    maskfile_entry *index;
+    // writing
+    FILE *f;
+    int cap;
+    uint64_t pos;
+    uint8_t *buf;
+    // reading
+    uint8_t *map;
+    size_t map_size;
+} maskfile;
+
+int maskfile_create(maskfile *m, char *name, int w, int h, int codec);
+int maskfile_append(maskfile *m, int frame, uint8_t *data, int stride);
+// Entry i (not frame number i) into a w x h buffer.
+int maskfile_read(maskfile *m, int i, uint8_t *out, int stride);
+// Entry holding frame, or -1.
+int maskfile_find(maskfile *m, int frame);
+// Memory maps name; reads are then random access.
+int maskfile_open(maskfile *m, char *name);
+// Finishes a file being written, or unmaps one being read.
+int maskfile_close(maskfile *m);
+
+#endif /* JOSH_MASKFILE_H */
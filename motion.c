@@ -1,9 +1,12 @@
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
 #include <x264.h>
 #include <opencv2/imgproc/imgproc_c.h>
 #include "encode.h"
 #include "capture.h"
+#include "roi.h"
+#include "sal.h"
 
 #include <sys/time.h>
 static inline double get_time()
@@ -39,7 +42,7 @@ static float* vec_f(int w, int h)
 static int **history_i(int w, int h)
 {
     int i;
-    int **vec = malloc(NBAVG*sizeof(int));
+    int **vec = malloc(NBAVG*sizeof(int*));
     if (!vec) return NULL;
     for (i = 0; i < NBAVG; i++)
         if (!(vec[i] = vec_i(w, h))) return NULL;
@@ -49,7 +52,7 @@ static int **history_i(int w, int h)
 static float **get_history(int w, int h)
 {
     int i;
-    float **avgs = malloc(NBAVG*sizeof(float));
+    float **avgs = malloc(NBAVG*sizeof(float*));
     if (!avgs) return NULL;
     for (i = 0; i < NBAVG; i++)
         if (!(avgs[i] = vec_f(w, h))) return NULL;
@@ -123,6 +126,9 @@ static void calc_mbdiffs(float **history, float *avg, int *fg,
 
 IplImage *gray, *avg, *i32, *diff;
 
+// a pixel counts as changed this far off its running average
+#define CHGTHRESH (8/255.0)
+
 static void calc_avgimg(IplImage *img)
 {
     // normalize to 0..1
@@ -140,12 +146,25 @@ int main(int argc, char **argv)
     x264_picture_t *pic_in, *pic_out;
     int w, h;
     struct SwsContext *sws;
+    roi r;
+    // -r: quant offsets from the share of changed pixels per macroblock,
+    // reduced by roi a frame ahead of the encoder. Frames are captured
+    // into two buffers in turn so frame i is encoded while frame i+1's
+    // map is reduced; the maps handed to roi alternate the same way.
+    // -s: the same, from video saliency instead of the change map.
+    int use_sal = argc > 1 && !strcmp(argv[1], "-s");
+    int use_roi = use_sal || (argc > 1 && !strcmp(argv[1], "-r"));
+    IplImage *chg[2] = {NULL, NULL}, *bgr = NULL;
+    uint8_t *bgr_data[4];
+    sal_video sv;
+    int k = 0, primed = 0;
 
     start_capture(&ctx);
     w = ctx.img->width;
     h = ctx.img->height;
     CvSize size = {.width = w, .height = h};
-    uint8_t *pbuf = malloc(avpicture_get_size(PIX_FMT_NV12, w, h));
+    int psize = avpicture_get_size(PIX_FMT_NV12, w, h);
+    uint8_t *pbuf = malloc(psize*2), *pbufs[2] = {pbuf, pbuf + psize};
     float *quant_offsets = vec_f(w, h);
     float *avgs = vec_f(w, h);
     float **history = get_history(w, h);
@@ -185,14 +204,47 @@ int main(int argc, char **argv)
     pic_in = &enc.pic_in;
     pic_out = &enc.pic_out;
     pic_in->prop.quant_offsets = quant_offsets;
+    if (use_roi) {
+        chg[0] = cvCreateImage(size, IPL_DEPTH_8U, 1);
+        chg[1] = cvCreateImage(size, IPL_DEPTH_8U, 1);
+        roi_new(&r, w, h, 10.0f);
+    }
+    if (use_sal) {
+        bgr = cvCreateImage(size, IPL_DEPTH_8U, 3);
+        av_image_fill_pointers(bgr_data, PIX_FMT_BGR24, h, (uint8_t*)bgr->imageData, rgb_stride);
+        sal_video_new(&sv, NULL);
+    }
 
     int nbf = 0;
     while (1) {
         int s, t;
+        av_image_fill_pointers(ctx.img_data, PIX_FMT_NV12, h, pbufs[k], ctx.d_stride);
+        gray->imageData = (char*)pbufs[k];
         IplImage *img = capture_frame(&ctx);
         if (!img) break;
         calc_avgimg(gray);
         calc_mbdiffs(history, avgs, bkg, bkg_hist, diff, nbf, quant_offsets);
+        if (use_roi) {
+            // chg[!k] may still be read by roi; this frame's goes in chg[k]
+            if (use_sal) {
+                sws_scale(sws, (const uint8_t* const*)ctx.img_data, ctx.d_stride, 0, h, bgr_data, rgb_stride);
+                cvConvertScale(sal_video_frame(&sv, bgr), chg[k], 255, 0);
+            } else cvCmpS(diff, CHGTHRESH, chg[k], CV_CMP_GT);
+            if (!primed) {
+                // nothing to encode until the next frame is in
+                roi_put(&r, chg[k]);
+                primed = 1;
+                k = !k;
+                release_frame(&ctx);
+                continue;
+            }
+            pic_in->prop.quant_offsets = roi_get(&r);
+            roi_put(&r, chg[k]);
+            // encode the frame before, from the other buffer
+            av_image_fill_pointers(enc.pic_in.img.plane, PIX_FMT_NV12, h, pbufs[!k], enc.pic_in.img.i_stride);
+            av_image_fill_pointers(ref.pic_in.img.plane, PIX_FMT_NV12, h, pbufs[!k], ref.pic_in.img.i_stride);
+            k = !k;
+        }
         s = encode_frame(&enc);
         t = encode_frame(&ref);
         if (!s || !t) goto endloop;
@@ -216,6 +268,15 @@ endloop:
     cvReleaseImage(&diff);
     sws_freeContext(sws);
     free(quant_offsets);
+    if (use_roi) {
+        roi_free(&r);
+        cvReleaseImage(&chg[0]);
+        cvReleaseImage(&chg[1]);
+    }
+    if (use_sal) {
+        sal_video_free(&sv);
+        cvReleaseImage(&bgr);
+    }
     stop_encode(&enc);
     stop_capture(&ctx);
     cvDestroyWindow("out");
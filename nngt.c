@@ -0,0 +1,458 @@
+// exact nearest neighbour ground truth; replaces gt/gt.ml.
+// every dst descriptor is compared against every src descriptor. rgb
+// mode matches single pixels by colour, as gt.ml did; gck mode matches
+// 8x8 patches with the descriptors and distance prop.c uses, then
+// reports how close the approximate matcher gets to the exact field.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <opencv2/imgproc/imgproc_c.h>
+#include <opencv2/highgui/highgui_c.h>
+
+#include "prop.h"
+#include "recon.h"
+#include "par.h"
+
+#define NN_LANES 8
+#define NN_SRC_TILE 2048    // candidates per pass; k*8KB, sits in L2
+#define NN_QRY_TILE 64      // queries that share each pass
+
+// Candidates are stored in blocks of NN_LANES, dimension-major inside
+// a block, so one vector load holds the same coefficient of eight
+// candidates. The last block is padded with copies of the final
+// candidate; those never win since ties go to the lower index.
+typedef struct nn_ctx {
+    int k;
+    int nb_cands, nb_blks;
+    int *soa;           // [blk][k][NN_LANES]
+    uint32_t *ids;      // id per candidate
+
+    int *qry;           // query i is at qry + qids[i]*k
+    uint32_t *qids;
+    int nb_qry;
+    uint32_t *best;     // id of the nearest candidate, per query
+    int64_t *dist;      // squared distance to it
+    int next;
+    int vec;
+} nn_ctx;
+
+static void print_usage(char **argv)
+{
+    printf("Usage: %s <rgb|gck> <src> <dst> <out> [threads]\n", argv[0]);
+    exit(1);
+}
+
+static IplImage *alignedImage(CvSize dim, int depth, int chan, int align)
+{
+    int w = dim.width, h = dim.height;
+    int dx = align - (w % align);
+    w += (dx != align) * dx;
+    CvSize s = {w, h};
+    return cvCreateImage(s, depth, chan);
+}
+
+static IplImage *alignedImageFrom(char *file, int align, CvSize *orig)
+{
+    IplImage *pre = cvLoadImage(file, CV_LOAD_IMAGE_COLOR);
+    if (!pre) {
+        fprintf(stderr, "nngt: unable to load %s\n", file);
+        exit(1);
+    }
+    IplImage *img = alignedImage(cvGetSize(pre), pre->depth, pre->nChannels, align);
+    char *pre_data = pre->imageData;
+    char *img_data = img->imageData;
+    int i;
+    cvSetZero(img);
+    for (i = 0; i < pre->height; i++) {
+        memcpy(img_data, pre_data, pre->widthStep);
+        img_data += img->widthStep;
+        pre_data += pre->widthStep;
+    }
+    *orig = cvGetSize(pre);
+    cvReleaseImage(&pre);
+    return img;
+}
+
+#include <sys/time.h>
+static inline double get_time()
+{
+    struct timeval t;
+    gettimeofday(&t, NULL);
+    return t.tv_sec + t.tv_usec * 1e-6;
+}
+
+// Candidate i is desc + ids[i]*k; ids are what the search returns.
+static void nn_new(nn_ctx *c, int *desc, uint32_t *ids, int n, int k)
+{
+    int b, d, l;
+    c->k = k;
+    c->nb_cands = n;
+    c->nb_blks = (n + NN_LANES - 1)/NN_LANES;
+    c->soa = malloc((size_t)c->nb_blks*k*NN_LANES*sizeof(int));
+    c->ids = malloc((size_t)c->nb_blks*NN_LANES*sizeof(uint32_t));
+    if (!c->soa || !c->ids) {
+        fprintf(stderr, "nngt: unable to allocate candidates\n");
+        exit(1);
+    }
+    for (b = 0; b < c->nb_blks; b++) {
+        for (l = 0; l < NN_LANES; l++) {
+            int i = b*NN_LANES + l < n ? b*NN_LANES + l : n - 1;
+            int *p = desc + (size_t)ids[i]*k;
+            c->ids[b*NN_LANES + l] = ids[i];
+            for (d = 0; d < k; d++) {
+                c->soa[((size_t)b*k + d)*NN_LANES + l] = p[d];
+            }
+        }
+    }
+    c->vec = 0;
+#if defined(__x86_64__) || defined(__i386__)
+    c->vec = __builtin_cpu_supports("avx2");
+#endif
+}
+
+static void nn_free(nn_ctx *c)
+{
+    free(c->soa);
+    free(c->ids);
+    memset(c, 0, sizeof(nn_ctx));
+}
+
+// Blocks b0..b1 against one query. *best and *pos carry over between
+// passes; candidates are visited in index order, so strict < keeps the
+// lowest index among equals.
+static void scan_c(nn_ctx *c, int *q, int b0, int b1, int64_t *best,
+    int *pos)
+{
+    int k = c->k, b, d, l;
+    for (b = b0; b < b1; b++) {
+        int *s = c->soa + (size_t)b*k*NN_LANES;
+        for (l = 0; l < NN_LANES; l++) {
+            int64_t dist = 0;
+            for (d = 0; d < k; d++) {
+                int64_t x = s[d*NN_LANES + l] - q[d];
+                dist += x*x;
+            }
+            if (dist < *best) {
+                *best = dist;
+                *pos = b*NN_LANES + l;
+            }
+        }
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_AVX2 1
+
+// Eight candidates per block. Differences fit 32 bits but their squares
+// summed over k may not, so even and odd lanes are squared separately
+// into 64 bit accumulators with mul_epi32.
+__attribute__((target("avx2")))
+static void scan_avx2(nn_ctx *c, int *q, int b0, int b1, int64_t *best,
+    int *pos)
+{
+    int k = c->k, b, d, i;
+    int *s = c->soa + (size_t)b0*k*NN_LANES;
+    int64_t dists[8], idx[8];
+    __m256i be = _mm256_set1_epi64x(INT64_MAX), bo = be;
+    __m256i ie = _mm256_setzero_si256(), io = ie;
+    __m256i ce = _mm256_setr_epi64x(0, 2, 4, 6), co;
+    const __m256i step = _mm256_set1_epi64x(NN_LANES);
+    ce = _mm256_add_epi64(ce, _mm256_set1_epi64x((int64_t)b0*NN_LANES));
+    co = _mm256_add_epi64(ce, _mm256_set1_epi64x(1));
+    for (b = b0; b < b1; b++) {
+        __m256i ae = _mm256_setzero_si256(), ao = ae, m;
+        for (d = 0; d < k; d++, s += NN_LANES) {
+            __m256i v = _mm256_loadu_si256((__m256i*)s);
+            __m256i x = _mm256_sub_epi32(v, _mm256_set1_epi32(q[d]));
+            ae = _mm256_add_epi64(ae, _mm256_mul_epi32(x, x));
+            x = _mm256_srli_epi64(x, 32);
+            ao = _mm256_add_epi64(ao, _mm256_mul_epi32(x, x));
+        }
+        m = _mm256_cmpgt_epi64(be, ae);
+        be = _mm256_blendv_epi8(be, ae, m);
+        ie = _mm256_blendv_epi8(ie, ce, m);
+        m = _mm256_cmpgt_epi64(bo, ao);
+        bo = _mm256_blendv_epi8(bo, ao, m);
+        io = _mm256_blendv_epi8(io, co, m);
+        ce = _mm256_add_epi64(ce, step);
+        co = _mm256_add_epi64(co, step);
+    }
+    _mm256_storeu_si256((__m256i*)dists, be);
+    _mm256_storeu_si256((__m256i*)(dists + 4), bo);
+    _mm256_storeu_si256((__m256i*)idx, ie);
+    _mm256_storeu_si256((__m256i*)(idx + 4), io);
+    for (i = 0; i < 8; i++) {
+        if (dists[i] < *best || (dists[i] == *best && idx[i] < *pos)) {
+            *best = dists[i];
+            *pos = idx[i];
+        }
+    }
+}
+#endif
+
+static void nn_thr(void *arg, int id)
+{
+    nn_ctx *c = (nn_ctx*)arg;
+    int nb_tiles = (c->nb_qry + NN_QRY_TILE - 1)/NN_QRY_TILE;
+    int step = NN_SRC_TILE/NN_LANES, t, i, b0, b1;
+    int64_t best[NN_QRY_TILE];
+    int pos[NN_QRY_TILE];
+    (void)id;
+    while ((t = __atomic_fetch_add(&c->next, 1, __ATOMIC_RELAXED)) <
+        nb_tiles) {
+        int q0 = t*NN_QRY_TILE, n = c->nb_qry - q0;
+        if (n > NN_QRY_TILE) n = NN_QRY_TILE;
+        for (i = 0; i < n; i++) {
+            best[i] = INT64_MAX;
+            pos[i] = INT32_MAX;
+        }
+        // a pass over one source tile for every query of the tile,
+        // then the next source tile
+        for (b0 = 0; b0 < c->nb_blks; b0 += step) {
+            b1 = b0 + step < c->nb_blks ? b0 + step : c->nb_blks;
+            for (i = 0; i < n; i++) {
+                int *q = c->qry + (size_t)c->qids[q0 + i]*c->k;
+#ifdef HAVE_AVX2
+                if (c->vec) {
+                    scan_avx2(c, q, b0, b1, &best[i], &pos[i]);
+                    continue;
+                }
+#endif
+                scan_c(c, q, b0, b1, &best[i], &pos[i]);
+            }
+        }
+        for (i = 0; i < n; i++) {
+            c->best[q0 + i] = c->ids[pos[i]];
+            c->dist[q0 + i] = best[i];
+        }
+    }
+}
+
+// Query i is qry + qids[i]*k. Fills c->best and c->dist, which belong
+// to the caller.
+static void nn_run(nn_ctx *c, int *qry, uint32_t *qids, int n,
+    uint32_t *best, int64_t *dist, int nb_threads)
+{
+    c->qry = qry;
+    c->qids = qids;
+    c->nb_qry = n;
+    c->best = best;
+    c->dist = dist;
+    c->next = 0;
+    par_run(nb_threads, nn_thr, c);
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(uint64_t*)a, y = *(uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+// Per pixel colours, 3 ints each, indexed y*w + x. Entries are keyed
+// colour << 32 | index and sorted so each colour is only searched for
+// once, at its lowest index.
+static int *rgb_desc(IplImage *img, CvSize orig, uint64_t **keys)
+{
+    int w = img->width, x, y, n = 0;
+    int *desc = malloc((size_t)w*img->height*3*sizeof(int));
+    *keys = malloc((size_t)orig.width*orig.height*sizeof(uint64_t));
+    for (y = 0; y < orig.height; y++) {
+        uint8_t *p = (uint8_t*)img->imageData + y*img->widthStep;
+        for (x = 0; x < orig.width; x++, p += 3) {
+            uint32_t i = y*w + x;
+            desc[i*3] = p[0];
+            desc[i*3 + 1] = p[1];
+            desc[i*3 + 2] = p[2];
+            (*keys)[n++] = (uint64_t)(p[0] | p[1] << 8 | p[2] << 16) << 32 | i;
+        }
+    }
+    qsort(*keys, n, sizeof(uint64_t), cmp_u64);
+    return desc;
+}
+
+static int unique_ids(uint64_t *keys, int n, uint32_t *ids)
+{
+    int i, u = 0;
+    for (i = 0; i < n; i++) {
+        if (i && keys[i] >> 32 == keys[i-1] >> 32) continue;
+        ids[u++] = (uint32_t)keys[i];
+    }
+    return u;
+}
+
+static void match_rgb(IplImage *src, CvSize sorig, IplImage *dst,
+    CvSize dorig, prop_field *f, int nb_threads)
+{
+    int ns = sorig.width*sorig.height, nd = dorig.width*dorig.height;
+    int i, u, nu, ncands;
+    uint64_t *skeys, *dkeys;
+    int *sdesc = rgb_desc(src, sorig, &skeys);
+    int *ddesc = rgb_desc(dst, dorig, &dkeys);
+    uint32_t *sids = malloc(ns*sizeof(uint32_t));
+    uint32_t *dids = malloc(nd*sizeof(uint32_t));
+    uint32_t *best = malloc(nd*sizeof(uint32_t));
+    int64_t *dist = malloc(nd*sizeof(int64_t));
+    nn_ctx c;
+
+    ncands = unique_ids(skeys, ns, sids);
+    nu = unique_ids(dkeys, nd, dids);
+    printf("nngt: %d src colours, %d dst colours\n", ncands, nu);
+    nn_new(&c, sdesc, sids, ncands, 3);
+    nn_run(&c, ddesc, dids, nu, best, dist, nb_threads);
+
+    // every pixel of a colour gets that colour's match
+    memset(f->idx, 0, (size_t)f->w*f->h*sizeof(uint32_t));
+    for (i = 0, u = -1; i < nd; i++) {
+        uint32_t p = (uint32_t)dkeys[i];
+        if (!i || dkeys[i] >> 32 != dkeys[i-1] >> 32) u++;
+        f->idx[(p / dst->width)*f->w + p % dst->width] = best[u];
+    }
+
+    nn_free(&c);
+    free(sdesc);
+    free(ddesc);
+    free(skeys);
+    free(dkeys);
+    free(sids);
+    free(dids);
+    free(best);
+    free(dist);
+}
+
+// Descriptors come one per patch position, (w - 8 + 1) to a row, which
+// is also the order of a field's entries. Only patches that lie inside
+// orig are listed; the rest overlap the alignment padding.
+static uint32_t *patch_ids(IplImage *img, CvSize orig, int *n)
+{
+    int gw = img->width - 8 + 1, x, y;
+    int ow = orig.width - 8 + 1, oh = orig.height - 8 + 1;
+    uint32_t *ids;
+    if (ow <= 0 || oh <= 0) {
+        fprintf(stderr, "nngt: images have to be at least 8x8\n");
+        exit(1);
+    }
+    ids = malloc((size_t)ow*oh*sizeof(uint32_t));
+    *n = 0;
+    for (y = 0; y < oh; y++) {
+        for (x = 0; x < ow; x++) ids[(*n)++] = y*gw + x;
+    }
+    return ids;
+}
+
+// Entries of f over the padding get index 0 and a dist of -1.
+static void match_gck(IplImage *src, CvSize sorig, IplImage *dst,
+    CvSize dorig, prop_field *f, int64_t *dist, int nb_threads)
+{
+    int plane_coeffs[] = {2, 9, 5}, k = 16, ns, nd, i;
+    int gw = src->width - 8 + 1, *sdesc, *ddesc;
+    uint32_t *sids = patch_ids(src, sorig, &ns);
+    uint32_t *dids = patch_ids(dst, dorig, &nd);
+    uint32_t *best = malloc(nd*sizeof(uint32_t));
+    int64_t *bdist = malloc(nd*sizeof(int64_t));
+    nn_ctx c;
+
+    prop_coeffs(src, plane_coeffs, &sdesc);
+    prop_coeffs(dst, plane_coeffs, &ddesc);
+    nn_new(&c, sdesc, sids, ns, k);
+    nn_run(&c, ddesc, dids, nd, best, bdist, nb_threads);
+    memset(f->idx, 0, (size_t)f->w*f->h*sizeof(uint32_t));
+    for (i = 0; i < f->w*f->h; i++) dist[i] = -1;
+    // patch positions to source pixel indices
+    for (i = 0; i < nd; i++) {
+        f->idx[dids[i]] = (best[i] / gw)*src->width + best[i] % gw;
+        dist[dids[i]] = bdist[i];
+    }
+
+    nn_free(&c);
+    free(sdesc);
+    free(ddesc);
+    free(sids);
+    free(dids);
+    free(best);
+    free(bdist);
+}
+
+// How the approximate matcher does on the same pair: the share of
+// patches where it found an exact match (or a tie), and its summed
+// distance over the exact one, over the patches match_gck scored.
+static void compare_prop(IplImage *src, IplImage *dst, int64_t *dist,
+    int nb_threads)
+{
+    int i, n = 0, exact = 0;
+    double sum = 0, asum = 0, start, end;
+    prop_matcher m;
+    prop_opts opts;
+    prop_field *a;
+    memset(&opts, 0, sizeof(prop_opts));
+    opts.nb_threads = nb_threads;
+    opts.dist = 1;
+    prop_matcher_new(&m, src, &opts);
+    start = get_time();
+    a = prop_matcher_match(&m, dst);
+    end = get_time();
+    for (i = 0; i < a->w*a->h; i++) {
+        if (dist[i] < 0) continue; // over the padding
+        n++;
+        if (a->dist[i] <= dist[i]) exact++;
+        sum += dist[i];
+        asum += a->dist[i];
+    }
+    printf("prop: elapsed %f exact %f dist %f\n", (end - start)*1000,
+        exact/(double)n, sum > 0 ? asum/sum : 1.0);
+    prop_matcher_free(&m);
+}
+
+int main(int argc, char **argv)
+{
+    int nb_threads = 0, rgb;
+    double start, end;
+    CvSize sorig, dorig;
+    prop_field f;
+    int64_t *dist = NULL;
+    IplImage *src, *dst, *out;
+    if (argc < 5) print_usage(argv);
+    if (!strcmp(argv[1], "rgb")) rgb = 1;
+    else if (!strcmp(argv[1], "gck")) rgb = 0;
+    else print_usage(argv);
+    if (argc > 5) nb_threads = atoi(argv[5]);
+    printf("nngt: %s \"%s\" \"%s\" \"%s\"\n", argv[1], argv[2], argv[3],
+        argv[4]);
+    src = alignedImageFrom(argv[2], 8, &sorig);
+    dst = alignedImageFrom(argv[3], 8, &dorig);
+    out = cvCreateImage(cvGetSize(dst), dst->depth, dst->nChannels);
+    cvSetZero(out);
+
+    start = get_time();
+    if (rgb) {
+        f.w = dst->width;
+        f.h = dst->height;
+        f.src_w = src->width;
+        f.src_h = src->height;
+        f.idx = malloc((size_t)f.w*f.h*sizeof(uint32_t));
+        f.dist = NULL;
+        match_rgb(src, sorig, dst, dorig, &f, nb_threads);
+    } else {
+        prop_field_new(&f, cvGetSize(dst), cvGetSize(src), 0);
+        dist = malloc((size_t)f.w*f.h*sizeof(int64_t));
+        match_gck(src, sorig, dst, dorig, &f, dist, nb_threads);
+    }
+    end = get_time();
+    printf("elapsed %f\n", (end - start)*1000);
+    if (!rgb) compare_prop(src, dst, dist, nb_threads);
+
+    recon_field_mt(&f, src, out, nb_threads);
+    CvRect roi = {0, 0, dorig.width, dorig.height};
+    cvSetImageROI(out, roi);
+    cvSaveImage(argv[4], out, 0);
+
+    prop_field_free(&f);
+    free(dist);
+    cvReleaseImage(&out);
+    cvReleaseImage(&src);
+    cvReleaseImage(&dst);
+    return 0;
+}
@@ -0,0 +1,62 @@
+// tiny fork/join helper; everything else is done with atomics by
+// the callers.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "par.h"
+
+typedef struct par_job {
+    void (*fn)(void *arg, int id);
+    void *arg;
+    int id;
+} par_job;
+
+int par_ncpus()
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? n : 1;
+}
+
+int par_threads(int nb)
+{
+    // <= 0 means 'use everything'
+    return nb > 0 ? nb : par_ncpus();
+}
+
+static void* par_thr(void *arg)
+{
+    par_job *job = (par_job*)arg;
+    job->fn(job->arg, job->id);
+    return NULL;
+}
+
+void par_run(int nb, void (*fn)(void *arg, int id), void *arg)
+{
+    int i;
+    pthread_t *thrs;
+    par_job *jobs;
+    nb = par_threads(nb);
+    if (nb == 1) {
+        fn(arg, 0);
+        return;
+    }
+    thrs = malloc(nb*sizeof(pthread_t));
+    jobs = malloc(nb*sizeof(par_job));
+    for (i = 1; i < nb; i++) {
+        jobs[i].fn = fn;
+        jobs[i].arg = arg;
+        jobs[i].id = i;
+        if (pthread_create(&thrs[i], NULL, par_thr, &jobs[i])) {
+            // callers may wait on each other, so every id must run
+            fprintf(stderr, "par: unable to create thread %d\n", i);
+            exit(1);
+        }
+    }
+    fn(arg, 0);
+    for (i = 1; i < nb; i++) pthread_join(thrs[i], NULL);
+    free(thrs);
+    free(jobs);
+}
@@ -0,0 +1,8 @@
+#ifndef JOSH_PAR_H
+#define JOSH_PAR_H
+
+int par_ncpus();
+int par_threads(int nb);
+void par_run(int nb, void (*fn)(void *arg, int id), void *arg);
+
+#endif /* JOSH_PAR_H */
@@ -4,6 +4,8 @@
 #include <opencv2/highgui/highgui_c.h>
 #include <opencv2/imgproc/imgproc_c.h>
 
+#include "recon.h"
+
 #define PATCH_W 7
 #define PM_ITERS 5
 #define RS_MAX INT_MAX
@@ -17,26 +19,20 @@ static int min(int a, int b) { return a <= b ? a : b; }
 static int dist(IplImage *a, IplImage *b, int ax, int ay, int bx, int by, int cutoff)
 {
     int ans = 0, dx, dy;
-    uint8_t *adata = (uint8_t*)a->imageData;
-    uint8_t *bdata = (uint8_t*)b->imageData;
     int astride = a->widthStep, bstride = b->widthStep;
+    uint8_t *ad = (uint8_t*)a->imageData + ay * astride + ax * 3;
+    uint8_t *bd = (uint8_t*)b->imageData + by * bstride + bx * 3;
     if (cutoff <= 0) cutoff = INT_MAX;
     for (dy = 0; dy < PATCH_W; dy++) {
-        for (dx = 0; dx < PATCH_W; dx++) {
-            int al = (dy+ay) * astride + (dx+ax) * 3;
-            int bl = (dy+by) * bstride + (dx+bx) * 3;
-            uint8_t *ad = adata + al;
-            int ar = ad[0];
-            int ag = ad[1];
-            int ab = ad[2];
-            uint8_t *bd = bdata + bl;
-            int br = bd[0];
-            int bg = bd[1];
-            int bb = bd[2];
-            int dr = ar - br, dg = ag - bg, db = ab - bb;
-            ans +=  dr*dr + dg*dg + db*db;
+        // a patch row is contiguous; let the compiler vectorize it
+        for (dx = 0; dx < PATCH_W * 3; dx++) {
+            int d = ad[dx] - bd[dx];
+            ans += d*d;
         }
-        if (ans > cutoff) return cutoff;
+        // callers only take strict improvements, so ties can bail too
+        if (ans >= cutoff) return cutoff;
+        ad += astride;
+        bd += bstride;
     }
     return ans;
 }
@@ -132,28 +128,6 @@ static void patchmatch(IplImage *a, IplImage *b, IplImage *ann, IplImage *annd)
     }
 }
 
-static void xy2img(IplImage *xy, IplImage *img, IplImage *recon)
-{
-    int w = xy->width, h = xy->height, i, j;
-    int xystride = xy->widthStep/sizeof(int32_t);
-    int rstride = recon->widthStep;
-    int stride = img->widthStep;
-    int32_t *xydata = (int32_t*)xy->imageData;
-    uint8_t *rdata = (uint8_t*)recon->imageData;
-    uint8_t *data = (uint8_t*)img->imageData;
-
-    for (i = 0; i < h; i++) {
-        for (j = 0; j < w; j++) {
-            int v = xydata[i*xystride + j];
-            int x = XY_TO_X(v), y = XY_TO_Y(v);
-            int rd = i*rstride + j*3, dd = y*stride + x*3;
-            *(rdata + rd + 0) = *(data + dd + 0);
-            *(rdata + rd + 1) = *(data + dd + 1);
-            *(rdata + rd + 2) = *(data + dd + 2);
-        }
-    }
-}
-
 #undef XY_TO_INT
 #undef XY_TO_X
 #undef XY_TO_Y
@@ -215,7 +189,7 @@ int main(int argc, char **argv)
     printf("patchmatch: \"%s\" \"%s\" \"%s\"\n", s, d, g);
     start = get_time();
     patchmatch(a, b, ann, annd);
-    xy2img(ann, b, recon);
+    recon_xy(ann, b, recon);
     end = get_time();
     cvAbsDiff(recon, a, diff);
     cvAbsDiff(gt, a, gtdiff);
@@ -0,0 +1,171 @@
+// Background frame loader for image sequences.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <opencv2/imgproc/imgproc_c.h>
+#include <opencv2/highgui/highgui_c.h>
+
+#include "prefetch.h"
+
+enum { SLOT_FREE, SLOT_LOADING, SLOT_READY, SLOT_TAKEN };
+
+static prefetch_slot *slot_of(prefetch *p, int i)
+{
+    return &p->slots[(i - p->start) % p->depth];
+}
+
+static int aligned(int v, int align)
+{
+    return !(v % align);
+}
+
+// cvLoadImage allocates every decoded frame; it has no way to decode
+// into a given buffer. Already aligned frames are used as decoded.
+// Others are copied into the slot's buffer, which is only reallocated
+// if the size changes, and the decoded frame is released.
+static void load(prefetch *p, prefetch_slot *s, int i)
+{
+    char name[1024];
+    IplImage *pre = cvLoadImage(p->name(name, sizeof(name), p->path, i),
+        CV_LOAD_IMAGE_COLOR);
+    int w, h, y;
+    if (!pre) {
+        fprintf(stderr, "prefetch: unable to load %s\n", name);
+        exit(1);
+    }
+    s->orig = cvGetSize(pre);
+    if (aligned(pre->width, p->align) && aligned(pre->height, p->align)) {
+        s->img = pre;
+        return;
+    }
+    w = pre->width + p->align - 1 - (pre->width + p->align - 1) % p->align;
+    h = pre->height + p->align - 1 - (pre->height + p->align - 1) % p->align;
+    if (s->buf && (s->buf->width != w || s->buf->height != h ||
+        s->buf->depth != pre->depth || s->buf->nChannels != pre->nChannels)) {
+        cvReleaseImage(&s->buf);
+    }
+    if (!s->buf) {
+        CvSize sz = {w, h};
+        s->buf = cvCreateImage(sz, pre->depth, pre->nChannels);
+    }
+    for (y = 0; y < pre->height; y++) {
+        memcpy(s->buf->imageData + y*s->buf->widthStep,
+            pre->imageData + y*pre->widthStep, pre->widthStep);
+    }
+    cvReleaseImage(&pre);
+    s->img = s->buf;
+}
+
+static void *decode_thr(void *arg)
+{
+    prefetch *p = (prefetch*)arg;
+    prefetch_slot *s;
+    int i;
+    for (;;) {
+        pthread_mutex_lock(&p->lock);
+        while (!p->quit && p->next <= p->end &&
+            slot_of(p, p->next)->state != SLOT_FREE) {
+            pthread_cond_wait(&p->freed, &p->lock);
+        }
+        if (p->quit || p->next > p->end) {
+            pthread_mutex_unlock(&p->lock);
+            break;
+        }
+        i = p->next++;
+        s = slot_of(p, i);
+        s->state = SLOT_LOADING;
+        s->frame = i;
+        pthread_mutex_unlock(&p->lock);
+
+        load(p, s, i);
+
+        pthread_mutex_lock(&p->lock);
+        s->state = SLOT_READY;
+        pthread_cond_broadcast(&p->ready);
+        pthread_mutex_unlock(&p->lock);
+    }
+    return NULL;
+}
+
+void prefetch_new(prefetch *p, prefetch_name name, char *path,
+    int start, int end, int align, int nb_threads, int depth)
+{
+    int i;
+    memset(p, 0, sizeof(*p));
+    p->name = name;
+    p->path = path;
+    p->start = p->next = start;
+    p->end = end;
+    p->align = align > 0 ? align : 1;
+    p->depth = depth > 0 ? depth : 1;
+    p->nb_threads = nb_threads > 0 ? nb_threads : 1;
+    p->slots = calloc(p->depth, sizeof(prefetch_slot));
+    p->thrs = malloc(p->nb_threads*sizeof(pthread_t));
+    for (i = 0; i < p->depth; i++) p->slots[i].frame = -1;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->ready, NULL);
+    pthread_cond_init(&p->freed, NULL);
+    for (i = 0; i < p->nb_threads; i++) {
+        if (pthread_create(&p->thrs[i], NULL, decode_thr, p)) {
+            fprintf(stderr, "prefetch: unable to create thread %d\n", i);
+            exit(1);
+        }
+    }
+}
+
+IplImage *prefetch_get(prefetch *p, int i, CvSize *orig)
+{
+    prefetch_slot *s;
+    IplImage *img;
+    if (i < p->start || i > p->end) return NULL;
+    s = slot_of(p, i);
+    pthread_mutex_lock(&p->lock);
+    while (s->frame != i || s->state != SLOT_READY) {
+        pthread_cond_wait(&p->ready, &p->lock);
+    }
+    s->state = SLOT_TAKEN;
+    img = s->img;
+    if (orig) *orig = s->orig;
+    pthread_mutex_unlock(&p->lock);
+    return img;
+}
+
+void prefetch_release(prefetch *p, int i)
+{
+    prefetch_slot *s;
+    if (i < p->start || i > p->end) return;
+    s = slot_of(p, i);
+    pthread_mutex_lock(&p->lock);
+    if (s->frame == i && s->state == SLOT_TAKEN) {
+        if (s->img != s->buf) cvReleaseImage(&s->img);
+        s->img = NULL;
+        s->frame = -1;
+        s->state = SLOT_FREE;
+        pthread_cond_broadcast(&p->freed);
+    }
+    pthread_mutex_unlock(&p->lock);
+}
+
+void prefetch_free(prefetch *p)
+{
+    int i;
+    pthread_mutex_lock(&p->lock);
+    p->quit = 1;
+    pthread_cond_broadcast(&p->freed);
+    pthread_mutex_unlock(&p->lock);
+    for (i = 0; i < p->nb_threads; i++) pthread_join(p->thrs[i], NULL);
+    for (i = 0; i < p->depth; i++) {
+        prefetch_slot *s = &p->slots[i];
+        if (s->img && s->img != s->buf) cvReleaseImage(&s->img);
+        if (s->buf) cvReleaseImage(&s->buf);
+    }
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->ready);
+    pthread_cond_destroy(&p->freed);
+    free(p->slots);
+    free(p->thrs);
+    memset(p, 0, sizeof(*p));
+}
@@ -0,0 +1,41 @@
+#ifndef JOSH_PREFETCH_H
+#define JOSH_PREFETCH_H
+
+#include <pthread.h>
+
+// Decodes frames start..end of an image sequence ahead of the consumer
+// on a few threads. Frames are padded to a multiple of align and land
+// in a fixed ring of buffers that get reused, so at most depth frames
+// are in flight. Frames may be taken in any order inside the window,
+// but each has to be released before the ring can move past it.
+
+typedef char *(*prefetch_name)(char *buf, int len, char *path, int i);
+
+typedef struct prefetch_slot {
+    IplImage *img;  // handed out; buf, or the decoded image itself
+    IplImage *buf;  // pooled aligned buffer
+    CvSize orig;    // size before alignment
+    int frame;
+    int state;
+} prefetch_slot;
+
+typedef struct prefetch {
+    prefetch_name name;
+    char *path;
+    int start, end, align, depth, nb_threads;
+    int next;       // next frame to decode
+    int quit;
+    prefetch_slot *slots;
+    pthread_t *thrs;
+    pthread_mutex_t lock;
+    pthread_cond_t ready, freed;
+} prefetch;
+
+void prefetch_new(prefetch *p, prefetch_name name, char *path,
+    int start, int end, int align, int nb_threads, int depth);
+// Blocks until frame i is decoded. orig may be NULL.
+IplImage *prefetch_get(prefetch *p, int i, CvSize *orig);
+void prefetch_release(prefetch *p, int i);
+void prefetch_free(prefetch *p);
+
+#endif /* JOSH_PREFETCH_H */
@@ -2,31 +2,52 @@
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#include <sched.h>
 
 #include <opencv2/imgproc/imgproc_c.h>
 #include <opencv2/highgui/highgui_c.h>
 
 #include "gck.h"
 #include "kdtree.h"
+#include "prop.h"
+#include "par.h"
 
 #define XY_TO_INT(x, y) (((y) << 16) | (x))
+#define XY_TO_X(x) ((x)&((1<<16)-1))
+#define XY_TO_Y(y) ((y)>>16)
 
 #define PACK_SCOREIDX(s, i) ((uint64_t)((uint64_t)s << 32 | (i)))
 #define UNPACK_SCORE(a) ((a) >> 32)
 #define UNPACK_IDX(a) ((a)&(0xFFFFFFFF))
 
+// Partial distance: bail out once the running sum reaches bound. The
+// gck bases are roughly energy-ordered so most losers are rejected
+// within the first chunk. Anything returned >= bound is not exact.
+#define SCORE_CHUNK 4
+static int patch_score(int *c1, int *c2, int k, int bound)
+{
+    int i, j, dist = 0;
+    for (i = 0; i + SCORE_CHUNK <= k; i += SCORE_CHUNK) {
+        for (j = 0; j < SCORE_CHUNK; j++) {
+            int a = c1[i+j];
+            int b = c2[i+j];
+            dist += (a-b)*(a-b);
+        }
+        if (dist >= bound) return dist;
+    }
+    for (; i < k; i++) {
+        int a = c1[i];
+        int b = c2[i];
+        dist += (a-b)*(a-b);
+    }
+    return dist;
+}
+
 static int64_t match_score(int *coeffs, kd_node *n, int k)
 {
-    int i, j, *u, *v, **p = n->value, best = INT_MAX, idx = -1;
+    int i, **p = n->value, best = INT_MAX, idx = -1;
     for (i = 0; i < n->nb; i++) {
-        int dist = 0;
-        u = coeffs;
-        v = *p++;
-        for (j = 0; j < k; j++) {
-            int a = *u++;
-            int b = *v++;
-            dist += (a - b)*(a - b);
-        }
+        int dist = patch_score(coeffs, *p++, k, best);
         if (dist < best) {
             best = dist;
             idx = i;
@@ -35,95 +56,323 @@ static int64_t match_score(int *coeffs, kd_node *n, int k)
     return PACK_SCOREIDX(best, idx);
 }
 
-static int patch_score(int *c1, int *c2, int k)
+// Candidate lists are kept worst-first: scores[0] is the one to beat,
+// scores[nb-1] is the best match so far.
+static inline void keep_best(int attempt, int off, int *scores, int *pos,
+    int nb)
 {
-    int i, dist = 0;
-    for (i = 0; i < k; i++) {
-        int a = *c1++;
-        int b = *c2++;
-        dist += (a-b)*(a-b);
+    int i;
+    if (attempt >= scores[0]) return;
+    pos[0] = off;
+    scores[0] = attempt;
+    for (i = 0; i < nb - 1 && scores[i] < scores[i+1]; i++) {
+        int t = scores[i];
+        scores[i] = scores[i+1];
+        scores[i+1] = t;
+        t = pos[i];
+        pos[i] = pos[i+1];
+        pos[i+1] = t;
     }
-    return dist;
 }
 
-static void swap2(int *scores, int *index)
+// Candidates are patch indices into the source's descriptor grid.
+static inline void check_guide(kd_tree *t, int *coeffs, int idx,
+    int *scores, int *pos, int nb)
 {
-    int t = scores[0];
-    scores[0] = scores[1];
-    scores[1] = t;
-    int u = index[0];
-    index[0] = index[1];
-    index[1] = u;
+    if ((size_t)idx >= (size_t)(t->end - t->start)/t->k) return;
+    int *points = t->start + (size_t)idx*t->k;
+    int attempt = patch_score(coeffs, points, t->k, scores[0]);
+    keep_best(attempt, idx, scores, pos, nb);
 }
 
-static inline void check_guide(kd_tree *t, int *coeffs, int off,
-    int *scores, int *pos)
+typedef struct enrich_cfg {
+    int nb;         // candidates kept per pixel
+    int guides;     // PROP_GUIDE_*
+    int w;          // row length, for the top-right guide
+    int tmp_thresh; // skip the tree if temporal guides do this well
+    int thresh;     // same, for all guides; -1 to always query first
+} enrich_cfg;
+
+static void spatial_guides(kd_tree *t, enrich_cfg *cfg, int *coeffs,
+    int x, int y, int *left, int *top, int *diag, int *scores, int *pos)
 {
-    if (t->start + off >= t->end) return;
-    int *points = t->start + off;
-    int attempt = patch_score(coeffs, points, t->k);
-    if (attempt < scores[0]) {
-        pos[0] = off;
-        scores[0] = attempt;
-        if (scores[0] < scores[1]) swap2(scores, pos);
+    int i, nb = cfg->nb;
+
+    // retained matches for the left, best first
+    if (x) {
+        for (i = nb - 1; i >= 0; i--)
+            check_guide(t, coeffs, left[i], scores, pos, nb);
+    }
+
+    // retained matches for the top
+    if (y) {
+        for (i = 0; i < nb; i++)
+            check_guide(t, coeffs, top[i], scores, pos, nb);
+    }
+
+    if (y && x && (cfg->guides & PROP_GUIDE_DIAG)) {
+        for (i = 0; i < nb; i++)
+            check_guide(t, coeffs, diag[i], scores, pos, nb);
+    }
+
+    if (y && x + 1 < cfg->w && (cfg->guides & PROP_GUIDE_TOPRIGHT)) {
+        for (i = 0; i < nb; i++)
+            check_guide(t, coeffs, top[i + nb], scores, pos, nb);
     }
 }
 
-static unsigned match_enrich(kd_tree *t, int *coeffs, int x, int y,
-    int *prev)
+static unsigned match_enrich(kd_tree *t, enrich_cfg *cfg, int *coeffs,
+    int x, int y, int *left, int *top, int *diag, int *cur,
+    int *tmp, int nb_tmp, int *dist)
 {
-    int k = t->k, *start = t->start;
-    kd_node *n  = kdt_query(t, coeffs);
+    int k = t->k, *start = t->start, i, nb = cfg->nb, skip = 0, spatial = 0;
+    int best[PROP_MAX_CANDS], pos[PROP_MAX_CANDS];
 
-    // set results of query
-    int64_t res = match_score(coeffs, n, k);
-    int best[] = {INT_MAX, UNPACK_SCORE(res)};
-    int pos[] = {INT_MAX, n->value[UNPACK_IDX(res)] - start};
+    for (i = 0; i < nb; i++) best[i] = pos[i] = INT_MAX;
 
-    pos[0] = pos[1]; // hack for (x,y) == (0,0)
+    // temporal or coarse level guides go first so they can stand in
+    // for the tree; a flat tree (no root) never gets queried
+    for (i = 0; i < nb_tmp; i++)
+        check_guide(t, coeffs, tmp[i], best, pos, nb);
+    if (pos[nb-1] != INT_MAX && best[nb-1] <= cfg->tmp_thresh) skip = 1;
 
-    // now check 2 best matches for the left
-    if (x) {
-        check_guide(t, coeffs, prev[-1], best, pos);
-        check_guide(t, coeffs, prev[-2], best, pos);
+    if (cfg->thresh >= 0 && !skip) {
+        spatial_guides(t, cfg, coeffs, x, y, left, top, diag, best, pos);
+        if (pos[nb-1] != INT_MAX && best[nb-1] <= cfg->thresh) skip = 1;
+        spatial = 1;
     }
 
-    // check 2 best matches for top
-    if (y) {
-        check_guide(t, coeffs, prev[0], best, pos);
-        check_guide(t, coeffs, prev[1], best, pos);
+    if (!skip && t->root) {
+        kd_node *n  = kdt_query(t, coeffs);
+        int64_t res = match_score(coeffs, n, k);
+        keep_best(UNPACK_SCORE(res), (n->value[UNPACK_IDX(res)] - start)/k,
+            best, pos, nb);
+    }
+
+    // hack for (x,y) == (0,0)
+    for (i = 0; i < nb - 1; i++) {
+        if (pos[i] == INT_MAX) pos[i] = pos[nb-1];
     }
 
-    // set prev to best matches
-    prev[0] = pos[0];
-    prev[1] = pos[1];
-    return pos[1];
+    // skipping only ever saves the tree; left and top still propagate
+    if (!spatial) {
+        spatial_guides(t, cfg, coeffs, x, y, left, top, diag, best, pos);
+    }
+
+    // patch indices of the kept matches into cur, worst first; cur may
+    // be the same memory left or top came from, both read by now
+    for (i = 0; i < nb; i++) cur[i] = pos[i];
+    if (dist) *dist = best[nb-1];
+    return pos[nb-1];
 }
 
-static IplImage* match(kd_tree *t, int *coeffs, IplImage *src,
-    CvSize dst_size)
+// Wavefront scheduling. Pixel (x, y) depends on (x-1, y) and (x, y-1),
+// plus (x+1, y-1) with the top-right guide, so rows are dealt
+// round-robin to threads and row y only proceeds past column x once
+// row y-1 has finished it (or x+1). The left and top-left neighbours
+// are carried in locals, so two shared rows are enough: row y+1 can't
+// overwrite row y-1's column x before row y has read it. Output is
+// bit-identical to the serial path.
+#define MATCH_SYNC 32 // columns between progress updates
+
+typedef struct match_ctx {
+    kd_tree *t;
+    enrich_cfg cfg;
+    int *coeffs;
+    IplImage *src;
+    prop_field *out;
+    prop_field *prev;   // previous frame's correspondences, if any
+    prop_field *coarse; // next pyramid level's correspondences, if any
+    int w, h, sw, sh, nb, lag, radius;
+    int *prevs; // cfg.nb ints per column, 2 rows
+    int *done;  // columns completed, per row
+} match_ctx;
+
+// Candidates from the previous frame: the match at the same location,
+// plus the 4-neighbours' matches shifted back so the patches line up.
+#define NB_TEMPORAL 5
+static int temporal_guides(match_ctx *ctx, int x, int y, int *guides)
+{
+    static const int dx[] = {0, -1, 1, 0, 0}, dy[] = {0, 0, 0, -1, 1};
+    prop_field *prev = ctx->prev;
+    int i, nb = 0;
+    for (i = 0; i < NB_TEMPORAL; i++) {
+        int px = x + dx[i], py = y + dy[i], sx, sy;
+        uint32_t v;
+        if ((unsigned)px >= (unsigned)ctx->w) continue;
+        if ((unsigned)py >= (unsigned)ctx->h) continue;
+        v = prev->idx[(size_t)py*prev->w + px];
+        sx = v % prev->src_w - dx[i];
+        sy = v / prev->src_w - dy[i];
+        if ((unsigned)sx >= (unsigned)ctx->sw) continue;
+        if ((unsigned)sy >= (unsigned)ctx->sh) continue;
+        guides[nb++] = sy*ctx->sw + sx;
+    }
+    return nb;
+}
+
+// Candidates from the next coarser level: a window around the parent's
+// match, scaled up.
+#define NB_WINDOW ((2*PROP_MAX_RADIUS+1)*(2*PROP_MAX_RADIUS+1))
+static int window_guides(match_ctx *ctx, int x, int y, int *guides)
 {
-    IplImage *xy = cvCreateImage(dst_size, IPL_DEPTH_32S, 1);
-    int w = dst_size.width  - 8 + 1, h = dst_size.height - 8 + 1;
-    int k = t->k, sz = w*h, i, sw = src->width - 8 + 1;
-    int *prevs = malloc(w*sizeof(int)*2), *prev = prevs;
-    int *xydata = (int*)xy->imageData;
-    for (i = 0; i < sz; i++) {
-        int x = i % w, y = i/w, sx, sy, sxy;
-        if (!x) {
-            prev = prevs;
-            xydata = (int*)xy->imageData + y*(xy->widthStep/sizeof(int));
+    prop_field *c = ctx->coarse;
+    int cx = x/2 < c->w ? x/2 : c->w - 1, cy = y/2 < c->h ? y/2 : c->h - 1;
+    uint32_t v = c->idx[(size_t)cy*c->w + cx];
+    int sx = 2*(v % c->src_w) + (x & 1), sy = 2*(v / c->src_w) + (y & 1);
+    int r = ctx->radius, nb = 0, i, j;
+    if (sx >= ctx->sw) sx = ctx->sw - 1;
+    if (sy >= ctx->sh) sy = ctx->sh - 1;
+    for (i = sy - r; i <= sy + r; i++) {
+        if ((unsigned)i >= (unsigned)ctx->sh) continue;
+        for (j = sx - r; j <= sx + r; j++) {
+            if ((unsigned)j >= (unsigned)ctx->sw) continue;
+            guides[nb++] = i*ctx->sw + j;
+        }
+    }
+    return nb;
+}
+
+static void match_row(match_ctx *ctx, int y)
+{
+    kd_tree *t = ctx->t;
+    IplImage *src = ctx->src;
+    int w = ctx->w, k = t->k, sw = ctx->sw, x, sx, sy, sxy, avail = 0;
+    int nb = ctx->cfg.nb, i, need;
+    int left[PROP_MAX_CANDS], diag[PROP_MAX_CANDS];
+    int tmp[NB_TEMPORAL + NB_WINDOW], nb_tmp;
+    int *coeffs = ctx->coeffs + y*w*k;
+    int *cur = ctx->prevs + (y & 1)*w*nb, *top = ctx->prevs + (~y & 1)*w*nb;
+    size_t row = (size_t)y*ctx->out->w;
+    uint32_t *idx = ctx->out->idx + row;
+    uint32_t *dist = ctx->out->dist ? ctx->out->dist + row : NULL;
+    int score;
+    int *wait = y ? &ctx->done[y-1] : NULL, *done = &ctx->done[y];
+    for (x = 0; x < w; x++) {
+        need = x + ctx->lag < w ? x + ctx->lag : w;
+        while (wait && avail < need) {
+            avail = __atomic_load_n(wait, __ATOMIC_ACQUIRE);
+            if (avail < need) sched_yield();
+        }
+        nb_tmp = 0;
+        if (ctx->prev) nb_tmp = temporal_guides(ctx, x, y, tmp);
+        if (ctx->coarse) {
+            nb_tmp += window_guides(ctx, x, y, tmp + nb_tmp);
+        }
+        sxy = match_enrich(t, &ctx->cfg, coeffs, x, y, left, top, diag,
+            cur, tmp, nb_tmp, &score);
+        for (i = 0; i < nb; i++) {
+            left[i] = cur[i];
+            diag[i] = top[i];
         }
-        sxy = match_enrich(t, coeffs, x, y, prev) / k;
         sx = sxy % sw; sy = sxy / sw;
-        *xydata++ = XY_TO_INT(sx, sy);
+        idx[x] = (uint32_t)sy*src->width + sx;
+        if (dist) dist[x] = score;
         if (sx >= src->width || sy >= src->height) {
             printf("grievous error: got %d,%d but dims %d,%d sxy %d\n", sx, sy, src->width, src->height, sxy);
         }
         coeffs += k;
-        prev += 2;
+        top += nb;
+        cur += nb;
+        if (!((x+1) % MATCH_SYNC)) {
+            __atomic_store_n(done, x+1, __ATOMIC_RELEASE);
+        }
+    }
+    __atomic_store_n(done, w, __ATOMIC_RELEASE);
+}
+
+static void match_thr(void *arg, int id)
+{
+    match_ctx *ctx = (match_ctx*)arg;
+    int y;
+    for (y = id; y < ctx->h; y += ctx->nb) match_row(ctx, y);
+}
+
+static void match(kd_tree *t, int *coeffs, IplImage *src, prop_field *out,
+    prop_opts *opts, prop_field *coarse)
+{
+    match_ctx ctx;
+    int w = out->w, h = out->h, nb;
+    prop_field *prev = opts ? opts->prev : NULL;
+    ctx.t = t;
+    ctx.coeffs = coeffs;
+    ctx.src = src;
+    ctx.out = out;
+    ctx.w = w;
+    ctx.h = h;
+    ctx.sw = src->width - 8 + 1;
+    ctx.sh = src->height - 8 + 1;
+    if (prev && (prev->w != w || prev->h != h ||
+        prev->src_w != src->width || prev->src_h != src->height)) {
+        fprintf(stderr, "prop: previous frame size mismatch; ignoring\n");
+        prev = NULL;
+    }
+    ctx.prev = prev;
+    ctx.coarse = coarse;
+    ctx.radius = opts && opts->radius > 0 ? opts->radius : 2;
+    if (ctx.radius > PROP_MAX_RADIUS) ctx.radius = PROP_MAX_RADIUS;
+    nb = opts && opts->nb_cands > 0 ? opts->nb_cands : 2;
+    if (nb > PROP_MAX_CANDS) nb = PROP_MAX_CANDS;
+    ctx.cfg.nb = nb;
+    ctx.cfg.guides = opts ? opts->guides : 0;
+    ctx.cfg.w = w;
+    ctx.cfg.tmp_thresh = opts ? opts->temporal_thresh : 0;
+    ctx.cfg.thresh = opts && opts->guide_first ? opts->guide_thresh : -1;
+    ctx.lag = ctx.cfg.guides & PROP_GUIDE_TOPRIGHT ? 2 : 1;
+    ctx.nb = par_threads(opts ? opts->nb_threads : 0);
+    if (ctx.nb > h) ctx.nb = h;
+    ctx.prevs = malloc(w*nb*sizeof(int)*2);
+    ctx.done = calloc(h, sizeof(int));
+    par_run(ctx.nb, match_thr, &ctx);
+    free(ctx.prevs);
+    free(ctx.done);
+}
+
+void prop_field_new(prop_field *f, CvSize dst_size, CvSize src_size,
+    int with_dist)
+{
+    size_t n;
+    f->w = dst_size.width - 8 + 1;
+    f->h = dst_size.height - 8 + 1;
+    f->src_w = src_size.width;
+    f->src_h = src_size.height;
+    if ((size_t)f->src_w*f->src_h > INT_MAX) {
+        fprintf(stderr, "prop: source over %d pixels\n", INT_MAX);
+        exit(1);
+    }
+    n = (size_t)f->w*f->h;
+    f->idx = malloc(n*sizeof(uint32_t));
+    f->dist = with_dist ? malloc(n*sizeof(uint32_t)) : NULL;
+    if (!f->idx || (with_dist && !f->dist)) {
+        fprintf(stderr, "prop: unable to allocate field\n");
+        exit(1);
+    }
+}
+
+void prop_field_free(prop_field *f)
+{
+    free(f->idx);
+    free(f->dist);
+    memset(f, 0, sizeof(*f));
+}
+
+IplImage *prop_field_xy(prop_field *f)
+{
+    CvSize size = {f->w + 8 - 1, f->h + 8 - 1};
+    IplImage *xy = cvCreateImage(size, IPL_DEPTH_32S, 1);
+    uint32_t *idx = f->idx;
+    int x, y;
+    if (f->src_w > 0xFFFF || f->src_h > 0xFFFF) {
+        fprintf(stderr, "prop: source too large to pack as xy\n");
+        exit(1);
+    }
+    cvSetZero(xy);
+    for (y = 0; y < f->h; y++) {
+        int32_t *row = (int32_t*)(xy->imageData + y*xy->widthStep);
+        for (x = 0; x < f->w; x++, idx++) {
+            row[x] = XY_TO_INT(*idx % f->src_w, *idx / f->src_w);
+        }
     }
-    free(prevs);
     return xy;
 }
 
@@ -149,78 +398,278 @@ static void interleave_data(int *data, int w, int h, int kern_size,
     }
 }
 
-static void coeffs_i(IplImage *img, int bases, int total_b, int *data)
+static void *grow(void *p, int *cur, int size)
 {
-    CvSize s = cvGetSize(img);
-    int w = s.width, h = s.height;
-    if (w != img->widthStep) {
-        fprintf(stderr, "image not aligned uh oh\n");
+    if (size <= *cur) return p;
+    free(p);
+    p = malloc(size);
+    if (!p) {
+        fprintf(stderr, "prop: unable to allocate scratch\n");
         exit(1);
     }
-    int *res = gck_calc_2d((uint8_t*)img->imageData, w, h, 8, bases);
-    interleave_data(res, w, h, 8, bases, data, total_b);
-    free(res);
+    *cur = size;
+    return p;
 }
 
-static void coeffs(IplImage *img, int dim, int *pc, int **in) {
+static void coeffs_i(uint8_t *plane, int w, int h, int bases, int total_b,
+    int *data, prop_scratch *s)
+{
+    int sz = (w + 8 - 1)*(h + 8 - 1)*bases*sizeof(int);
+    s->gck = grow(s->gck, &s->gck_size, sz);
+    gck_calc_2d_into(plane, w, h, 8, bases, s->gck);
+    interleave_data(s->gck, w, h, 8, bases, data, total_b);
+}
+
+// Fills data, which must hold gck_alloc_buffer(w, h, 8, dim) ints.
+// Planes and gck output live in the scratch, so repeated calls only
+// allocate when the image grows.
+static void coeffs_into(IplImage *img, int dim, int *pc, int *data,
+    prop_scratch *s)
+{
     CvSize size = cvGetSize(img);
-    IplImage *lab = cvCreateImage(size, IPL_DEPTH_8U, 3);
-    IplImage *l = cvCreateImage(size, IPL_DEPTH_8U, 1);
-    IplImage *a = cvCreateImage(size, IPL_DEPTH_8U, 1);
-    IplImage *b = cvCreateImage(size, IPL_DEPTH_8U, 1);
     int w = size.width, h = size.height;
-    int *interleaved = gck_alloc_buffer(w, h, 8, dim);
+    uint8_t *planes;
+    IplImage *l, *a, *b;
+    if (w & 3) {
+        fprintf(stderr, "image not aligned uh oh\n");
+        exit(1);
+    }
+    s->planes = grow(s->planes, &s->planes_size, w*h*3);
+    planes = s->planes;
+    l = cvCreateImageHeader(size, IPL_DEPTH_8U, 1);
+    a = cvCreateImageHeader(size, IPL_DEPTH_8U, 1);
+    b = cvCreateImageHeader(size, IPL_DEPTH_8U, 1);
+    cvSetData(l, planes, w);
+    cvSetData(a, planes + w*h, w);
+    cvSetData(b, planes + 2*w*h, w);
 
-    cvCvtColor(img, lab, CV_BGR2YCrCb);
     cvSplit(img, l, a, b, NULL);
 
-    coeffs_i(l, pc[0], dim, interleaved);
+    coeffs_i(planes, w, h, pc[0], dim, data, s);
 
-    coeffs_i(a, pc[1], dim, interleaved+pc[0]);
+    coeffs_i(planes + w*h, w, h, pc[1], dim, data+pc[0], s);
 
-    coeffs_i(b, pc[2], dim, interleaved+pc[0]+pc[1]);
+    coeffs_i(planes + 2*w*h, w, h, pc[2], dim, data+pc[0]+pc[1], s);
 
-    cvReleaseImage(&lab);
-    cvReleaseImage(&l);
-    cvReleaseImage(&a);
-    cvReleaseImage(&b);
+    cvReleaseImageHeader(&l);
+    cvReleaseImageHeader(&a);
+    cvReleaseImageHeader(&b);
+}
 
-    *in = interleaved;
+static void coeffs(IplImage *img, int dim, int *pc, int **in) {
+    CvSize size = cvGetSize(img);
+    prop_scratch s;
+    memset(&s, 0, sizeof(s));
+    *in = gck_alloc_buffer(size.width, size.height, 8, dim);
+    coeffs_into(img, dim, pc, *in, &s);
+    free(s.planes);
+    free(s.gck);
 }
 
-IplImage* prop_match(IplImage *src, IplImage *dst)
+static CvSize half_size(CvSize s)
 {
-    int *srcdata, *dstdata;
-    CvSize src_size = cvGetSize(src), dst_size = cvGetSize(dst);
-    int w1 = src_size.width - 8 + 1, h1 = src_size.height - 8 + 1;
-    int sz = w1*h1, plane_coeffs[] = {2, 9, 5};
-    int dim = plane_coeffs[0] + plane_coeffs[1] + plane_coeffs[2];
-    kd_tree kdt;
+    // keep planes unpadded for gck
+    CvSize sz = {(s.width/2) & ~3, s.height/2};
+    return sz;
+}
+
+static IplImage *half(IplImage *img)
+{
+    CvSize sz = half_size(cvGetSize(img));
+    IplImage *ret = cvCreateImage(sz, img->depth, img->nChannels);
+    cvResize(img, ret, CV_INTER_AREA);
+    return ret;
+}
+
+// pyramid levels stop before one would drop under this
+static int too_small(CvSize s)
+{
+    return s.width < 32 || s.height < 32;
+}
+
+static int plane_coeffs[] = {2, 9, 5};
+#define PROP_DIM 16
+
+void prop_matcher_new(prop_matcher *m, IplImage *src, prop_opts *opts)
+{
+    int l, levels = opts && opts->levels > 1 ? opts->levels : 1;
+    int *pc = plane_coeffs;
+    memset(m, 0, sizeof(*m));
+    if (opts) m->opts = *opts;
+    if (levels > PROP_MAX_LEVELS) levels = PROP_MAX_LEVELS;
+    m->srcs[0] = src;
+    for (l = 1; l < levels; l++) {
+        if (too_small(half_size(cvGetSize(m->srcs[l-1])))) break;
+        m->srcs[l] = half(m->srcs[l-1]);
+    }
+    m->levels = l;
+    m->trees = calloc(m->levels, sizeof(kd_tree));
+
+    // Coarse-to-fine: only the coarsest level builds a tree. Each finer
+    // level takes its candidates from a small window around the parent's
+    // upsampled match, then propagates as usual.
+    for (l = 0; l < m->levels; l++) {
+        kd_tree *t = &m->trees[l];
+        CvSize s = cvGetSize(m->srcs[l]);
+        int sz = (s.width - 8 + 1)*(s.height - 8 + 1);
+        m->srcdata[l] = gck_alloc_buffer(s.width, s.height, 8, PROP_DIM);
+        coeffs_into(m->srcs[l], PROP_DIM, pc, m->srcdata[l], &m->scratch);
+        if (l == m->levels - 1) kdt_new(t, m->srcdata[l], sz, PROP_DIM);
+        else {
+            t->k = PROP_DIM;
+            t->start = m->srcdata[l];
+            t->end = m->srcdata[l] + sz*PROP_DIM;
+        }
+    }
+}
+
+static void release_dst(prop_matcher *m)
+{
+    int l;
+    for (l = 0; l < m->levels; l++) {
+        if (l && m->dsts[l]) cvReleaseImage(&m->dsts[l]);
+        prop_field_free(&m->fields[l]);
+        free(m->dstdata[l]);
+        m->dstdata[l] = NULL;
+    }
+    prop_field_free(&m->prev);
+}
+
+prop_field *prop_matcher_match(prop_matcher *m, IplImage *dst)
+{
+    CvSize size = cvGetSize(dst);
+    int l, levels = m->levels;
+    int *pc = plane_coeffs;
+    prop_opts lopts = m->opts;
+    prop_field t;
+    if (size.width != m->dst_size.width ||
+        size.height != m->dst_size.height) {
+        release_dst(m);
+        m->dst_size = size;
+    }
+    m->dsts[0] = dst;
+    for (l = 0; l < levels; l++) {
+        CvSize s = l ? half_size(cvGetSize(m->dsts[l-1])) : size;
+        if (l && too_small(s)) break;
+        if (l && !m->dsts[l])
+            m->dsts[l] = cvCreateImage(s, dst->depth, dst->nChannels);
+        if (l) cvResize(m->dsts[l-1], m->dsts[l], CV_INTER_AREA);
+        if (!m->dstdata[l])
+            m->dstdata[l] = gck_alloc_buffer(s.width, s.height, 8, PROP_DIM);
+        if (!m->fields[l].idx) {
+            prop_field_new(&m->fields[l], s, cvGetSize(m->srcs[l]),
+                !l && m->opts.dist);
+        }
+    }
+    // a small destination stops early; its coarsest level needs a tree
+    levels = l;
+    if (!m->trees[levels-1].root) {
+        CvSize s = cvGetSize(m->srcs[levels-1]);
+        int sz = (s.width - 8 + 1)*(s.height - 8 + 1);
+        kdt_new(&m->trees[levels-1], m->srcdata[levels-1], sz, PROP_DIM);
+    }
+
+    for (l = levels - 1; l >= 0; l--) {
+        // only the coarsest level in use queries its tree
+        kd_tree flat = m->trees[l];
+        if (l + 1 < levels) flat.root = NULL;
+        coeffs_into(m->dsts[l], PROP_DIM, pc, m->dstdata[l], &m->scratch);
+        lopts.prev = NULL; // full res only
+        if (!l && !m->opts.temporal) lopts.prev = m->opts.prev;
+        else if (!l && m->prev.idx) lopts.prev = &m->prev;
+        match(&flat, m->dstdata[l], m->srcs[l], &m->fields[l],
+            &lopts, l + 1 < levels ? &m->fields[l+1] : NULL);
+    }
+    if (!m->opts.temporal) return &m->fields[0];
+    // ping-pong so the next call can read this one while writing
+    t = m->fields[0];
+    m->fields[0] = m->prev;
+    m->prev = t;
+    if (!m->fields[0].idx) {
+        prop_field_new(&m->fields[0], size, cvGetSize(m->srcs[0]),
+            m->opts.dist);
+    }
+    return &m->prev;
+}
+
+void prop_matcher_free(prop_matcher *m)
+{
+    int l;
+    release_dst(m);
+    for (l = 0; l < m->levels; l++) {
+        kdt_free(&m->trees[l]);
+        free(m->srcdata[l]);
+        if (l) cvReleaseImage(&m->srcs[l]);
+    }
+    free(m->trees);
+    prop_scratch_free(&m->scratch);
+    memset(m, 0, sizeof(*m));
+}
+
+IplImage* prop_match_opts(IplImage *src, IplImage *dst, prop_opts *opts)
+{
+    prop_matcher m;
     IplImage *matched;
-    coeffs(src, dim, plane_coeffs, &srcdata);
-    coeffs(dst, dim, plane_coeffs, &dstdata);
-    memset(&kdt, 0, sizeof(kdt));
-    kdt_new(&kdt, srcdata, sz, dim);
-    matched  = match(&kdt, dstdata, src, dst_size);
-    free(srcdata);
-    free(dstdata);
-    kdt_free(&kdt);
+    prop_matcher_new(&m, src, opts);
+    m.opts.temporal = 0;
+    matched = prop_field_xy(prop_matcher_match(&m, dst));
+    prop_matcher_free(&m);
     return matched;
 }
 
+IplImage* prop_match(IplImage *src, IplImage *dst)
+{
+    return prop_match_opts(src, dst, NULL);
+}
+
 void prop_coeffs(IplImage *src, int *plane_coeffs, int **data)
 {
     int dim = plane_coeffs[0] + plane_coeffs[1] + plane_coeffs[2];
     return coeffs(src, dim, plane_coeffs, data);
 }
 
+void prop_coeffs_into(IplImage *src, int *plane_coeffs, int *data,
+    prop_scratch *s)
+{
+    int dim = plane_coeffs[0] + plane_coeffs[1] + plane_coeffs[2];
+    coeffs_into(src, dim, plane_coeffs, data, s);
+}
+
+void prop_scratch_free(prop_scratch *s)
+{
+    free(s->planes);
+    free(s->gck);
+    memset(s, 0, sizeof(*s));
+}
+
 IplImage *prop_match_complete(kd_tree *kdt, int *data, IplImage *src,
     CvSize dst_size)
 {
-    return match(kdt, data, src, dst_size);
+    return prop_match_complete_opts(kdt, data, src, dst_size, NULL);
+}
+
+IplImage *prop_match_complete_opts(kd_tree *kdt, int *data, IplImage *src,
+    CvSize dst_size, prop_opts *opts)
+{
+    prop_field f;
+    IplImage *xy;
+    prop_field_new(&f, dst_size, cvGetSize(src), 0);
+    match(kdt, data, src, &f, opts, NULL);
+    xy = prop_field_xy(&f);
+    prop_field_free(&f);
+    return xy;
+}
+
+void prop_match_field(kd_tree *kdt, int *data, IplImage *src,
+    prop_field *out, prop_opts *opts)
+{
+    match(kdt, data, src, out, opts, NULL);
 }
 
 unsigned prop_enrich(kd_tree *t, int *coeffs, int x, int y, int *prev)
 {
-    return match_enrich(t, coeffs, x, y, prev);
+    // prev holds patch indices; callers want descriptor offsets
+    enrich_cfg cfg = {2, 0, 0, 0, -1};
+    return match_enrich(t, &cfg, coeffs, x, y, prev - 2, prev, NULL, prev,
+        NULL, 0, NULL) * t->k;
 }
@@ -1,13 +1,111 @@
 #ifndef JOSH_PROP_H_
 #define JOSH_PROP_H_
 
+// Correspondence field. One entry per matched position, i.e. per dst
+// patch: (dst size - 8 + 1) in each axis. Entries are the source pixel
+// index y*src_w + x of the matched patch's top left corner. Patch
+// positions and tree sizes are int inside the matcher, so the source
+// is limited to INT_MAX pixels.
+typedef struct prop_field {
+    int w, h;
+    int src_w, src_h;
+    uint32_t *idx;
+    uint32_t *dist; // squared gck distance; NULL unless requested
+} prop_field;
+
+void prop_field_new(prop_field *f, CvSize dst_size, CvSize src_size,
+    int with_dist);
+void prop_field_free(prop_field *f);
+// legacy XY_TO_INT packed image, dst sized
+IplImage *prop_field_xy(prop_field *f);
+
+// zero-initialize for defaults
+typedef struct prop_opts {
+    int nb_threads; // matching threads; <= 0 uses every cpu
+
+    // temporal mode: seed each pixel with the matches from frame t-1
+    // (as returned by the previous call) and skip the tree descent
+    // when one of those scores at or below temporal_thresh.
+    prop_field *prev;
+    int temporal_thresh;
+
+    // enrichment: matches retained per pixel (2 if unset) and extra
+    // neighbours to propagate from. With guide_first the guides are
+    // scored before the tree, which is skipped when the best of them
+    // is at or below guide_thresh (0: exact matches only).
+    int nb_cands;
+    int guides;
+    int guide_first;
+    int guide_thresh;
+
+    // coarse-to-fine matching over this many pyramid levels; finer
+    // levels search +/- radius (2 if unset) around the upsampled
+    // coarse match instead of querying a tree. prop_match_opts only.
+    int levels;
+    int radius;
+
+    // prop_matcher only: feed each result back in as the prev of the
+    // next call, and fill in the distances of the result.
+    int temporal;
+    int dist;
+} prop_opts;
+
+#define PROP_MAX_CANDS 16
+#define PROP_MAX_LEVELS 8
+#define PROP_MAX_RADIUS 4
+#define PROP_GUIDE_DIAG     1 // top-left
+#define PROP_GUIDE_TOPRIGHT 2
+
 IplImage *prop_match(IplImage *src, IplImage *dst);
+IplImage *prop_match_opts(IplImage *src, IplImage *dst, prop_opts *opts);
+
+// Persistent matcher for many frames against one source. Descriptors
+// and the tree are built once; per-frame buffers are kept and reused
+// for as long as the destination size stays the same.
+typedef struct prop_scratch {
+    uint8_t *planes;
+    int *gck;
+    int planes_size, gck_size;
+} prop_scratch;
 
-// utility stuff
 struct kd_tree;
+typedef struct prop_matcher {
+    prop_opts opts;
+    int levels;
+    IplImage *srcs[PROP_MAX_LEVELS]; // 0 is the caller's
+    int *srcdata[PROP_MAX_LEVELS];
+    struct kd_tree *trees;           // one per level; built at the coarsest
+                                     // and wherever a dst stopped short
+
+    CvSize dst_size;
+    IplImage *dsts[PROP_MAX_LEVELS]; // 0 is the caller's
+    int *dstdata[PROP_MAX_LEVELS];
+    prop_field fields[PROP_MAX_LEVELS];
+    prop_field prev;                 // last result in temporal mode
+    prop_scratch scratch;
+} prop_matcher;
+
+// src must outlive the matcher. The returned field belongs to the
+// matcher and stays valid until the next match or free.
+void prop_matcher_new(prop_matcher *m, IplImage *src, prop_opts *opts);
+prop_field *prop_matcher_match(prop_matcher *m, IplImage *dst);
+void prop_matcher_free(prop_matcher *m);
+
+// utility stuff
 void prop_coeffs(IplImage *sr, int* plane_coeffs, int **data);
+// Into data, which holds (w - 8 + 1)*(h - 8 + 1)*dim ints for dim the
+// sum of plane_coeffs. The scratch starts zeroed and only grows, so one
+// can serve many images, largest first.
+void prop_coeffs_into(IplImage *src, int *plane_coeffs, int *data,
+    prop_scratch *s);
+void prop_scratch_free(prop_scratch *s);
 IplImage *prop_match_complete(struct kd_tree *kdt, int *data,
     IplImage *src, CvSize dst_size);
+IplImage *prop_match_complete_opts(struct kd_tree *kdt, int *data,
+    IplImage *src, CvSize dst_size, prop_opts *opts);
+// out must be allocated against src and the dst size data came from
+void prop_match_field(struct kd_tree *kdt, int *data, IplImage *src,
+    prop_field *out, prop_opts *opts);
 unsigned prop_enrich(struct kd_tree *dt, int *coeffs, int x, int y,
     int *prev);
 #endif /* JOSH_PROP_H_ */
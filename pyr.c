@@ -1,10 +1,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <limits.h>
+#include <float.h>
+#include <math.h>
 
 #include <opencv2/imgproc/imgproc_c.h>
 #include <opencv2/highgui/highgui_c.h>
 
+#include "ftsal.h"
+#include "par.h"
+
 static void print_usage(char **argv)
 {
     printf("Usage: %s <path> [outfile]\n", argv[0]);
@@ -28,107 +33,171 @@ static IplImage *pyrstep(IplImage *img)
     return pyrd;
 }
 
+// 9x9 box starting 5 left and up of each pixel, clipped to the image
+// the way cvSetImageROI clips it but always over 81. The sums come
+// from a summed area table, in double like cvSum; rows split over
+// every cpu.
+typedef struct window_job {
+    double *sat;    // (w+1)*(h+1), channels interleaved
+    IplImage *out;
+    int nb;
+} window_job;
+
+static void window_thr(void *arg, int id)
+{
+    window_job *j = (window_job*)arg;
+    IplImage *out = j->out;
+    int w = out->width, h = out->height, ch = out->nChannels, x, y, i;
+    int y0 = h*id/j->nb, y1 = h*(id + 1)/j->nb, stride = (w + 1)*ch;
+    for (y = y0; y < y1; y++) {
+        float *d = (float*)(out->imageData + y*out->widthStep);
+        int t = y - 5 < 0 ? 0 : y - 5, b = y + 4 > h ? h : y + 4;
+        double *st = j->sat + t*stride, *sb = j->sat + b*stride;
+        for (x = 0; x < w; x++) {
+            int l = (x - 5 < 0 ? 0 : x - 5)*ch, r = (x + 4 > w ? w : x + 4)*ch;
+            for (i = 0; i < ch; i++)
+                *d++ = (sb[r+i] - sb[l+i] - st[r+i] + st[l+i])/81.0;
+        }
+    }
+}
+
+// img is float
 static IplImage* window(IplImage *img)
 {
     CvSize sz = cvGetSize(img);
-    IplImage *out = cvCreateImage(sz, img->depth, img->nChannels);
-    int w = sz.width, h = sz.height, x, y, i;
-    int stride = out->widthStep/sizeof(float);
+    IplImage *out = cvCreateImage(sz, IPL_DEPTH_32F, img->nChannels);
+    int w = sz.width, h = sz.height, ch = img->nChannels, x, y, i;
+    int stride = (w + 1)*ch;
+    window_job j;
+    j.sat = calloc((size_t)(w + 1)*(h + 1)*ch, sizeof(double));
+    if (!j.sat) {
+        fprintf(stderr, "pyr: unable to allocate window sums\n");
+        exit(1);
+    }
     for (y = 0; y < h; y++) {
-        float *d = (float*)out->imageData + (y*stride);
-        for (x = 0; x < w; x++) {
-            CvRect roi = {x - 5, y - 5, 9, 9};
-            cvSetImageROI(img, roi);
-            for (i = 0; i < out->nChannels; i++) {
-                CvScalar sum = cvSum(img);
-                *d++ = sum.val[i]/81.0;
+        float *s = (float*)(img->imageData + y*img->widthStep);
+        double *up = j.sat + y*stride, *cur = up + stride;
+        for (i = 0; i < ch; i++) {
+            double run = 0;
+            for (x = 0; x < w; x++) {
+                run += s[x*ch + i];
+                cur[(x + 1)*ch + i] = up[(x + 1)*ch + i] + run;
             }
         }
     }
-    cvResetImageROI(img);
+    j.out = out;
+    j.nb = par_threads(0);
+    par_run(j.nb, window_thr, &j);
+    free(j.sat);
     return out;
 }
 
-// multi-scale contrast using a gaussian pyramid, described in [1]
-// [1]: Tie Lu, et al. Learning to Detect a Salient Object:
-// http://research.microsoft.com/en-us/um/people/jiansun/papers/SalientDetection_CVPR07.pdf
-static IplImage* dopyr(IplImage *img)
+#define PYR_LEVELS 5
+
+// Two full size buffers, ping-ponged: prev holds the last level brought
+// back up to full size, cur the new one. Each band of rows keeps its
+// own range so the passes need no locking.
+typedef struct pyr_job {
+    IplImage *prev, *cur, *sum;
+    float *min, *max;       // per band
+    float scale, shift;     // in float, as cvConvertScale does for 32F
+    float final;            // on the last level, the mean over levels
+    int nb;
+} pyr_job;
+
+// |prev - cur| into prev, and its range
+static void pyr_diff_thr(void *arg, int id)
 {
-    int i;
-    CvSize sz = cvGetSize(img);
-    IplImage *gray = cvCreateImage(sz, img->depth, 1);
-    IplImage *img0 = cvCreateImage(sz, IPL_DEPTH_32F, 1);
-    cvCvtColor(img, gray, CV_BGR2GRAY);
-    cvConvertScale(gray, img0, 1/255.0, 0);
-    IplImage *prev = img0, *prev_r = img0;
-    IplImage *out = cvCreateImage(sz, IPL_DEPTH_32F, img0->nChannels);
-    IplImage *sum = cvCreateImage(sz, out->depth, out->nChannels);
-    cvXor(sum, sum, sum, NULL);
-    for (i = 1; i < 6; i++) {
-        IplImage *level = pyrstep(prev);
-        IplImage *resized = resize(level, sz);
-        cvAbsDiff(prev_r, resized, out);
-        double min, max;
-        cvMinMaxLoc(out, &min, &max, NULL, NULL, NULL);
-        cvConvertScale(out, out, 1.0/(max - min), -min);
-        //cvMul(out, out, out, 1);
-        cvAcc(out, sum, NULL);
-        if (prev != img0) cvReleaseImage(&prev);
-        if (prev_r != img0) cvReleaseImage(&prev_r);
-        prev = level;
-        prev_r = resized;
+    pyr_job *j = (pyr_job*)arg;
+    int w = j->cur->width, h = j->cur->height, x, y;
+    int y0 = h*id/j->nb, y1 = h*(id + 1)/j->nb;
+    float min = FLT_MAX, max = -FLT_MAX;
+    for (y = y0; y < y1; y++) {
+        float *p = (float*)(j->prev->imageData + y*j->prev->widthStep);
+        float *c = (float*)(j->cur->imageData + y*j->cur->widthStep);
+        for (x = 0; x < w; x++) {
+            float d = fabsf(p[x] - c[x]);
+            p[x] = d;
+            if (d < min) min = d;
+            if (d > max) max = d;
+        }
     }
-    cvConvertScale(sum, out, 1.0/i, 0);
-    return out;
+    j->min[id] = min;
+    j->max[id] = max;
 }
 
-static IplImage *sum_channels(IplImage *img)
+// sum += prev*scale + shift, scaled to the mean after the last level
+static void pyr_acc_thr(void *arg, int id)
 {
-    /*CvMat hdr;
-    CvSize sz = {img->width, img->height};
-    IplImage out_hdr, *out = cvCreateImage(sz, img->depth, 3), *foo;
-    foo = cvReshape(img, &hdr, 3, img->width*img->height);
-    out = cvGetImage(&hdr, &out_hdr);
-    cvReduce(&out_hdr, out, 1, CV_REDUCE_SUM);
-    cvReshape(out, &hdr, 3, img->height);
-    return cvGetImage(&hdr, &out_hdr);*/
-    CvSize sz = cvGetSize(img);
-    IplImage *out = cvCreateImage(sz, img->depth, 1);
-    IplImage *a = cvCreateImage(sz, img->depth, 1);
-    IplImage *b = cvCreateImage(sz, img->depth, 1);
-    IplImage *c = cvCreateImage(sz, img->depth, 1);
-    cvXor(out, out, out, NULL);
-    cvSplit(img, a, b, c, NULL);
-    cvAcc(a, out, NULL);
-    cvAcc(b, out, NULL);
-    cvAcc(c, out, NULL);
-    cvReleaseImage(&a);
-    cvReleaseImage(&b);
-    cvReleaseImage(&c);
-    return out;
+    pyr_job *j = (pyr_job*)arg;
+    int w = j->sum->width, h = j->sum->height, x, y;
+    int y0 = h*id/j->nb, y1 = h*(id + 1)/j->nb;
+    for (y = y0; y < y1; y++) {
+        float *p = (float*)(j->prev->imageData + y*j->prev->widthStep);
+        float *s = (float*)(j->sum->imageData + y*j->sum->widthStep);
+        if (j->final) {
+            for (x = 0; x < w; x++) {
+                float v = p[x]*j->scale + j->shift;
+                s[x] = (s[x] + v)*j->final;
+            }
+        } else {
+            for (x = 0; x < w; x++) {
+                float v = p[x]*j->scale + j->shift;
+                s[x] += v;
+            }
+        }
+    }
 }
 
-// saliency map from Frequency-Tuned Salient Region Detection
-// http://infoscience.epfl.ch/record/135217/files/1708.pdf
-static IplImage* avgdiff(IplImage *img)
+// multi-scale contrast using a gaussian pyramid, described in [1]
+// [1]: Tie Lu, et al. Learning to Detect a Salient Object:
+// http://research.microsoft.com/en-us/um/people/jiansun/papers/SalientDetection_CVPR07.pdf
+static IplImage* dopyr(IplImage *img)
 {
-    int i;
+    int i, t;
     CvSize sz = cvGetSize(img);
-    IplImage *sm = cvCreateImage(sz, IPL_DEPTH_32F, img->nChannels);
-    IplImage *out = cvCreateImage(sz, IPL_DEPTH_32F, img->nChannels);
-    IplImage *lab = cvCreateImage(sz, IPL_DEPTH_32F, img->nChannels);
-    cvConvertScale(img, out, 1/255.0, 0);
-    cvCvtColor(out, lab, CV_BGR2Lab);
-    CvScalar avg = cvAvg(lab, NULL);
-    for (i = 0; i < lab->nChannels; i++) avg.val[i] = -avg.val[i];
-    cvSmooth(lab, sm, CV_GAUSSIAN, 5, 5, 0, 0);
-    cvAddS(sm, avg, out, NULL);
-    cvMul(out, out, out, 1);
-    IplImage *o = sum_channels(out);
-    cvReleaseImage(&out);
-    cvReleaseImage(&lab);
-    cvReleaseImage(&sm);
-    return o;
+    IplImage *gray = cvCreateImage(sz, img->depth, 1);
+    IplImage *levels[PYR_LEVELS + 1], *swap;
+    pyr_job j;
+
+    levels[0] = cvCreateImage(sz, IPL_DEPTH_32F, 1);
+    cvCvtColor(img, gray, CV_BGR2GRAY);
+    cvConvertScale(gray, levels[0], 1/255.0, 0);
+    cvReleaseImage(&gray);
+    // the levels themselves are small; only full size gets reused
+    for (i = 1; i <= PYR_LEVELS; i++) levels[i] = pyrstep(levels[i-1]);
+
+    j.prev = levels[0];
+    j.cur = cvCreateImage(sz, IPL_DEPTH_32F, 1);
+    j.sum = cvCreateImage(sz, IPL_DEPTH_32F, 1);
+    cvSetZero(j.sum);
+    j.nb = par_threads(0);
+    j.min = malloc(2*j.nb*sizeof(float));
+    j.max = j.min + j.nb;
+    for (i = 1; i <= PYR_LEVELS; i++) {
+        double min = FLT_MAX, max = -FLT_MAX;
+        // The upsample stays a cvResize of its own rather than folded
+        // into the diff pass: a hand-rolled cubic would not match
+        // OpenCV's coefficients and rounding bit for bit.
+        cvResize(levels[i], j.cur, CV_INTER_CUBIC);
+        par_run(j.nb, pyr_diff_thr, &j);
+        for (t = 0; t < j.nb; t++) {
+            if (j.min[t] < min) min = j.min[t];
+            if (j.max[t] > max) max = j.max[t];
+        }
+        j.scale = 1.0/(max - min);
+        j.shift = -min;
+        j.final = i == PYR_LEVELS ? 1.0/(PYR_LEVELS + 1) : 0;
+        par_run(j.nb, pyr_acc_thr, &j);
+        swap = j.prev;
+        j.prev = j.cur;
+        j.cur = swap;
+        cvReleaseImage(&levels[i]);
+    }
+    cvReleaseImage(&j.prev);
+    cvReleaseImage(&j.cur);
+    free(j.min);
+    return j.sum;
 }
 
 static void normalize(IplImage *img)
@@ -191,7 +260,12 @@ int main(int argc, char **argv)
     if (argc < 2) print_usage(argv);
     print_args(argc, argv);
     IplImage *img = cvLoadImage(argv[1], CV_LOAD_IMAGE_COLOR);
-    IplImage *out = avgdiff(img);
+    ft_sal ft;
+    ft_sal_new(&ft);
+    // saliency map from Frequency-Tuned Salient Region Detection
+    // http://infoscience.epfl.ch/record/135217/files/1708.pdf
+    IplImage *out = ft_saliency(&ft, img);
+    ft_sal_free(&ft);
     normalize(out);
     if (argc < 3) {
         //IplImage *bin = binarize(img);
@@ -0,0 +1,216 @@
+// Reconstruction from correspondence fields.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <opencv2/imgproc/imgproc_c.h>
+
+#include "prop.h"
+#include "recon.h"
+#include "par.h"
+
+#define XY_TO_X(x) ((x)&((1<<16)-1))
+#define XY_TO_Y(y) ((y)>>16)
+
+static void gather_row(uint8_t *d, uint8_t *s, uint32_t *idx, int n)
+{
+    int i;
+    for (i = 0; i < n; i++) {
+        uint8_t *p = s + (size_t)idx[i]*3;
+        *d++ = p[0];
+        *d++ = p[1];
+        *d++ = p[2];
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_GATHER 1
+
+// Eight pixels per iteration: 64 bit offsets so sources past 2^31
+// bytes still work, one 4 byte load per pixel, then the spare byte of
+// each is shuffled out. The second store spills 4 bytes past the
+// eighth pixel, so a full iteration needs ten pixels left; and the
+// load of pixel last would read a byte past the image, so the C loop
+// takes over from any group that uses it.
+__attribute__((target("avx2")))
+static int gather_row_avx2(uint8_t *d, uint8_t *s, uint32_t *idx, int n,
+    uint32_t last)
+{
+    const __m128i shuf = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10,
+        12, 13, 14, -1, -1, -1, -1);
+    const __m256i lim = _mm256_set1_epi32(last - 1);
+    int i;
+    if (!last) return 0;
+    for (i = 0; i + 9 < n; i += 8) {
+        __m256i v = _mm256_loadu_si256((__m256i*)(idx + i));
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(
+            _mm256_max_epu32(v, lim), lim)) != -1) break;
+        __m256i lo = _mm256_cvtepu32_epi64(
+            _mm_loadu_si128((__m128i*)(idx + i)));
+        __m256i hi = _mm256_cvtepu32_epi64(
+            _mm_loadu_si128((__m128i*)(idx + i + 4)));
+        lo = _mm256_add_epi64(lo, _mm256_add_epi64(lo, lo));
+        hi = _mm256_add_epi64(hi, _mm256_add_epi64(hi, hi));
+        __m128i a = _mm256_i64gather_epi32((int*)s, lo, 1);
+        __m128i b = _mm256_i64gather_epi32((int*)s, hi, 1);
+        _mm_storeu_si128((__m128i*)d, _mm_shuffle_epi8(a, shuf));
+        _mm_storeu_si128((__m128i*)(d + 12), _mm_shuffle_epi8(b, shuf));
+        d += 24;
+    }
+    return i;
+}
+#endif
+
+typedef struct recon_job {
+    prop_field *f;
+    IplImage *src, *dst;
+    int kernsz; // 0 for per pixel
+    int nb;
+    int packed; // src rows unpadded, so idx*3 is the byte offset
+    uint32_t last;  // last source pixel
+    int vec;
+} recon_job;
+
+static inline uint8_t *src_at(recon_job *j, uint32_t idx)
+{
+    if (j->packed) return (uint8_t*)j->src->imageData + (size_t)idx*3;
+    return (uint8_t*)j->src->imageData +
+        (size_t)(idx / j->f->src_w)*j->src->widthStep +
+        (idx % j->f->src_w)*3;
+}
+
+static void field_rows(recon_job *j, int y0, int y1)
+{
+    prop_field *f = j->f;
+    uint8_t *s = (uint8_t*)j->src->imageData;
+    int x, y;
+    for (y = y0; y < y1; y++) {
+        uint8_t *d = (uint8_t*)j->dst->imageData + y*j->dst->widthStep;
+        uint32_t *idx = f->idx + (size_t)y*f->w;
+        if (!j->packed) {
+            for (x = 0; x < f->w; x++) {
+                uint8_t *p = src_at(j, idx[x]);
+                *d++ = p[0];
+                *d++ = p[1];
+                *d++ = p[2];
+            }
+            continue;
+        }
+        x = 0;
+#ifdef HAVE_GATHER
+        if (j->vec) x = gather_row_avx2(d, s, idx, f->w, j->last);
+#endif
+        gather_row(d + x*3, s, idx + x, f->w - x);
+    }
+}
+
+// One memcpy per block row rather than per pixel.
+static void blks_rows(recon_job *j, int y0, int y1)
+{
+    prop_field *f = j->f;
+    int k = j->kernsz, len = k*3, x, y, r;
+    int sstride = j->src->widthStep, dstride = j->dst->widthStep;
+    for (y = y0; y < y1; y++) {
+        uint8_t *d = (uint8_t*)j->dst->imageData + y*k*dstride;
+        uint32_t *idx = f->idx + (size_t)y*f->w;
+        for (x = 0; x < f->w; x++, d += len) {
+            uint8_t *p = src_at(j, idx[x]);
+            for (r = 0; r < k; r++) memcpy(d + r*dstride, p + r*sstride, len);
+        }
+    }
+}
+
+static void recon_thr(void *arg, int id)
+{
+    recon_job *j = (recon_job*)arg;
+    int h = j->f->h, y0 = h*id/j->nb, y1 = h*(id + 1)/j->nb;
+    if (j->kernsz) blks_rows(j, y0, y1);
+    else field_rows(j, y0, y1);
+}
+
+static void recon_run(prop_field *f, IplImage *src, IplImage *dst,
+    int kernsz, int nb)
+{
+    recon_job j;
+    int k = kernsz ? kernsz : 1;
+    if (src->width < f->src_w || src->height < f->src_h ||
+        dst->width < f->w*k || dst->height < f->h*k) {
+        fprintf(stderr, "recon: field does not fit images\n");
+        exit(1);
+    }
+    j.f = f;
+    j.src = src;
+    j.dst = dst;
+    j.kernsz = kernsz;
+    j.nb = par_threads(nb);
+    if (j.nb > f->h) j.nb = f->h > 0 ? f->h : 1;
+    j.packed = src->width == f->src_w && src->widthStep == src->width*3;
+    j.last = (size_t)src->width*src->height - 1;
+    j.vec = 0;
+#ifdef HAVE_GATHER
+    j.vec = __builtin_cpu_supports("avx2");
+#endif
+    par_run(j.nb, recon_thr, &j);
+}
+
+void recon_field(prop_field *f, IplImage *src, IplImage *dst)
+{
+    recon_run(f, src, dst, 0, 1);
+}
+
+void recon_field_blks(prop_field *f, IplImage *src, IplImage *dst,
+    int kernsz)
+{
+    recon_run(f, src, dst, kernsz, 1);
+}
+
+void recon_field_mt(prop_field *f, IplImage *src, IplImage *dst,
+    int nb_threads)
+{
+    recon_run(f, src, dst, 0, nb_threads);
+}
+
+void recon_field_blks_mt(prop_field *f, IplImage *src, IplImage *dst,
+    int kernsz, int nb_threads)
+{
+    recon_run(f, src, dst, kernsz, nb_threads);
+}
+
+void recon_xy(IplImage *xy, IplImage *src, IplImage *dst)
+{
+    int w = xy->width, h = xy->height, i, j;
+    int stride = src->widthStep;
+    uint8_t *data = (uint8_t*)src->imageData;
+    for (i = 0; i < h; i++) {
+        int32_t *xydata = (int32_t*)(xy->imageData + i*xy->widthStep);
+        uint8_t *d = (uint8_t*)dst->imageData + i*dst->widthStep;
+        for (j = 0; j < w; j++) {
+            int v = xydata[j];
+            uint8_t *p = data + XY_TO_Y(v)*stride + XY_TO_X(v)*3;
+            *d++ = p[0];
+            *d++ = p[1];
+            *d++ = p[2];
+        }
+    }
+}
+
+void recon_xy_blks(IplImage *xy, IplImage *src, IplImage *dst, int kernsz)
+{
+    int w = xy->width, h = xy->height, len = kernsz*3, i, j, r;
+    int stride = src->widthStep, dstride = dst->widthStep;
+    uint8_t *data = (uint8_t*)src->imageData;
+    for (i = 0; i < h; i++) {
+        int32_t *xydata = (int32_t*)(xy->imageData + i*xy->widthStep);
+        uint8_t *d = (uint8_t*)dst->imageData + i*kernsz*dstride;
+        for (j = 0; j < w; j++, d += len) {
+            int v = xydata[j];
+            uint8_t *p = data + XY_TO_Y(v)*stride + XY_TO_X(v)*3;
+            for (r = 0; r < kernsz; r++) {
+                memcpy(d + r*dstride, p + r*stride, len);
+            }
+        }
+    }
+}
@@ -0,0 +1,26 @@
+#ifndef JOSH_RECON_H
+#define JOSH_RECON_H
+
+// Rebuild dst from src through a correspondence field: dst pixel (x, y)
+// becomes the src pixel at f->idx[y*f->w + x]. Images are 8 bit,
+// 3 channel; only the top left f->w x f->h pixels of dst are written.
+struct prop_field;
+void recon_field(struct prop_field *f, IplImage *src, IplImage *dst);
+
+// Same, but each entry is a kernsz x kernsz block: dst block (x, y)
+// is the src block whose top left is at f->idx[y*f->w + x].
+void recon_field_blks(struct prop_field *f, IplImage *src, IplImage *dst,
+    int kernsz);
+
+// Threaded over bands of rows; nb_threads <= 0 uses every cpu.
+void recon_field_mt(struct prop_field *f, IplImage *src, IplImage *dst,
+    int nb_threads);
+void recon_field_blks_mt(struct prop_field *f, IplImage *src,
+    IplImage *dst, int kernsz, int nb_threads);
+
+// Packed XY_TO_INT images, as from patchmatch or prop_field_xy. Every
+// entry of xy is used.
+void recon_xy(IplImage *xy, IplImage *src, IplImage *dst);
+void recon_xy_blks(IplImage *xy, IplImage *src, IplImage *dst, int kernsz);
+
+#endif /* JOSH_RECON_H */
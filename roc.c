@@ -1,59 +1,68 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include <opencv2/highgui/highgui_c.h>
 #include <opencv2/imgproc/imgproc_c.h>
 
+#include "maskfile.h"
+#include "rocstat.h"
+
 static void print_usage(char **argv)
 {
-    printf("Usage: %s <file1> <file2> <file3>\n", argv[0]);
+    printf("Usage: %s <gt> <map>\n"
+        "either may be a frame of a mask file, as file.msk:frame\n",
+        argv[0]);
     exit(1);
 }
 
-static int tp, fp, fn, tn;
-static void cmp_thresh(IplImage *a, IplImage *gt, double thresh)
+// Image file, or name.msk:frame out of a mask container.
+static IplImage* load(char *name)
 {
-    int w = gt->width, h = gt->height, x, y;
-    int stride = gt->widthStep;
-    uint8_t *tdata, *gdata;
-    IplImage *thr = cvCloneImage(a);
-    cvThreshold(a, thr, thresh, 0.0, CV_THRESH_TOZERO);
-    tp = 0, fp = 0, fn = 0, tn = 0;
-    for (y = 0; y < h; y++) {
-        tdata = (uint8_t*)thr->imageData + y*stride;
-        gdata = (uint8_t*)gt->imageData + y*stride;
-        for (x = 0; x < w; x++) {
-            if (*gdata && *tdata) tp++;
-            else if (*gdata) fn++;
-            else if (*tdata) fp++;
-            else tn++;
-            gdata++;
-            tdata++;
+    char *sep = strrchr(name, ':'), path[1024];
+    int len = sep ? sep - name : 0, i;
+    IplImage *img;
+    maskfile m;
+    if (!sep || len < 4 || strncmp(sep - 4, ".msk", 4) ||
+        len >= (int)sizeof(path)) {
+        img = cvLoadImage(name, CV_LOAD_IMAGE_GRAYSCALE);
+        if (!img) {
+            fprintf(stderr, "roc: unable to load %s\n", name);
+            exit(1);
         }
+        return img;
     }
-}
-
-static IplImage* resize(IplImage *img, CvSize sz)
-{
-    IplImage *ret = cvCreateImage(sz, img->depth, img->nChannels);
-    cvResize(img, ret, CV_INTER_CUBIC);
-    return ret;
+    memcpy(path, name, len);
+    path[len] = '\0';
+    if (maskfile_open(&m, path)) exit(1);
+    i = maskfile_find(&m, atoi(sep + 1));
+    if (i < 0) {
+        fprintf(stderr, "roc: no frame %s in %s\n", sep + 1, path);
+        exit(1);
+    }
+    CvSize size = {m.w, m.h};
+    img = cvCreateImage(size, IPL_DEPTH_8U, 1);
+    if (maskfile_read(&m, i, (uint8_t*)img->imageData, img->widthStep)) {
+        exit(1);
+    }
+    maskfile_close(&m);
+    return img;
 }
 
 static void find_roc(IplImage *a, IplImage *gt)
 {
-    int i, r = 0;
-    if (gt->width != a->width || gt->height != a->height) {
-        gt = resize(gt, cvGetSize(a));
-        r = 1;
-    }
-    for (i = 1; i < 255; i++) {
-        cmp_thresh(a, gt, i);
+    int i;
+    roc_stat r;
+    roc_point pts[ROC_LAST+1], *p;
+    roc_stat_new(&r, a, gt);
+    roc_stat_points(&r, pts);
+    for (i = ROC_FIRST; i <= ROC_LAST; i++) {
+        p = &pts[i];
         printf("%d: tp %d fp %d fn %d tn %d precision %f recall %f fpr %f\n",
-            i, tp, fp, fn, tn,
-            tp/(double)(tp+fp), tp/(double)(tp+fn),
-            fp/(double)(fp+tn));
+            i, p->tp, p->fp, p->fn, p->tn,
+            p->tp/(double)(p->tp+p->fp), p->tp/(double)(p->tp+p->fn),
+            p->fp/(double)(p->fp+p->tn));
     }
-    if (r) cvReleaseImage(&gt);
 }
 
 static void print_args(int argc, char **argv)
@@ -68,8 +77,8 @@ int main(int argc, char **argv)
 {
     if (argc < 3) print_usage(argv);
     print_args(argc, argv);
-    IplImage *in = cvLoadImage(argv[2], CV_LOAD_IMAGE_GRAYSCALE);
-    IplImage *gt = cvLoadImage(argv[1], CV_LOAD_IMAGE_GRAYSCALE);
+    IplImage *in = load(argv[2]);
+    IplImage *gt = load(argv[1]);
     find_roc(in, gt);
     cvReleaseImage(&in);
     cvReleaseImage(&gt);
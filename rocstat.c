@@ -0,0 +1,55 @@
+#include <stdint.h>
+#include <string.h>
+
+#include <opencv2/imgproc/imgproc_c.h>
+
+#include "rocstat.h"
+
+static void hist(roc_stat *r, IplImage *a, IplImage *gt)
+{
+    int w = gt->width, h = gt->height, x, y;
+    uint8_t *adata, *gdata;
+    memset(r, 0, sizeof(roc_stat));
+    for (y = 0; y < h; y++) {
+        adata = (uint8_t*)a->imageData + y*a->widthStep;
+        gdata = (uint8_t*)gt->imageData + y*gt->widthStep;
+        for (x = 0; x < w; x++) {
+            if (gdata[x]) r->pos[adata[x]]++;
+            else r->neg[adata[x]]++;
+        }
+    }
+}
+
+void roc_stat_new(roc_stat *r, IplImage *map, IplImage *gt)
+{
+    IplImage *rsz;
+    if (gt->width == map->width && gt->height == map->height) {
+        hist(r, map, gt);
+        return;
+    }
+    rsz = cvCreateImage(cvGetSize(map), gt->depth, gt->nChannels);
+    cvResize(gt, rsz, CV_INTER_CUBIC);
+    hist(r, map, rsz);
+    cvReleaseImage(&rsz);
+}
+
+// tp at threshold t is the number of positives scoring above t: a
+// cumulative sum of the histogram from the top down.
+void roc_stat_points(roc_stat *r, roc_point *pts)
+{
+    int i, above_pos = 0, above_neg = 0, np = 0, nn = 0;
+    for (i = 0; i < 256; i++) {
+        np += r->pos[i];
+        nn += r->neg[i];
+    }
+    for (i = 255; i >= ROC_FIRST; i--) {
+        if (i <= ROC_LAST) {
+            pts[i].tp = above_pos;
+            pts[i].fp = above_neg;
+            pts[i].fn = np - above_pos;
+            pts[i].tn = nn - above_neg;
+        }
+        above_pos += r->pos[i];
+        above_neg += r->neg[i];
+    }
+}
@@ -0,0 +1,24 @@
+#ifndef JOSH_ROCSTAT_H
+#define JOSH_ROCSTAT_H
+
+// ROC of a score map against a ground truth mask. Scores above a
+// threshold count as detections; any nonzero ground truth is positive.
+
+#define ROC_FIRST 1
+#define ROC_LAST 254
+
+typedef struct roc_stat {
+    int pos[256];   // positives by score
+    int neg[256];   // negatives by score
+} roc_stat;
+
+typedef struct roc_point {
+    int tp, fp, fn, tn;
+} roc_point;
+
+// Resizes gt to the map if they differ.
+void roc_stat_new(roc_stat *r, IplImage *map, IplImage *gt);
+// Counts for thresholds ROC_FIRST..ROC_LAST, indexed by threshold.
+void roc_stat_points(roc_stat *r, roc_point *pts);
+
+#endif /* JOSH_ROCSTAT_H */
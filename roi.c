@@ -0,0 +1,161 @@
+// Saliency driven quant offsets, a frame ahead of the encoder.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <opencv2/imgproc/imgproc_c.h>
+
+#include "roi.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Sums of each macroblock of a row of them, rows y0..y1 of an 8 bit
+// map. psadbw against zero adds up 16 bytes at a time, eight to a
+// half; the last block may be narrower.
+static void sum_row8(IplImage *m, int y0, int y1, int mb_x, uint32_t *sums)
+{
+    int x, y, full = m->width/16;
+    memset(sums, 0, mb_x*sizeof(uint32_t));
+    for (y = y0; y < y1; y++) {
+        uint8_t *p = (uint8_t*)m->imageData + y*m->widthStep;
+        x = 0;
+#ifdef __SSE2__
+        for (; x < full; x++) {
+            __m128i s = _mm_sad_epu8(_mm_loadu_si128((__m128i*)(p + x*16)),
+                _mm_setzero_si128());
+            sums[x] += _mm_cvtsi128_si32(s) +
+                _mm_cvtsi128_si32(_mm_srli_si128(s, 8));
+        }
+#endif
+        for (x *= 16; x < m->width; x++) sums[x/16] += p[x];
+    }
+}
+
+static void sum_row32f(IplImage *m, int y0, int y1, int mb_x, float *sums)
+{
+    int x, y;
+    memset(sums, 0, mb_x*sizeof(float));
+    for (y = y0; y < y1; y++) {
+        float *p = (float*)(m->imageData + y*m->widthStep);
+        for (x = 0; x < m->width; x++) sums[x/16] += p[x];
+    }
+}
+
+static void reduce(roi *r, IplImage *m, float *off)
+{
+    uint32_t *s8 = r->sums8;
+    float *sf = r->sumsf;
+    int bx, by;
+    for (by = 0; by < r->mb_y; by++) {
+        int y0 = by*16, y1 = y0 + 16 > r->h ? r->h : y0 + 16;
+        if (m->depth == IPL_DEPTH_8U) sum_row8(m, y0, y1, r->mb_x, s8);
+        else sum_row32f(m, y0, y1, r->mb_x, sf);
+        for (bx = 0; bx < r->mb_x; bx++) {
+            int x0 = bx*16, x1 = x0 + 16 > r->w ? r->w : x0 + 16;
+            float n = (x1 - x0)*(y1 - y0), mean;
+            if (m->depth == IPL_DEPTH_8U) mean = s8[bx]/(255.0f*n);
+            else mean = sf[bx]/n;
+            if (mean > 1) mean = 1;
+            if (mean < 0) mean = 0;
+            off[by*r->mb_x + bx] = r->strength*(1 - mean);
+        }
+    }
+}
+
+static void *roi_thr(void *arg)
+{
+    roi *r = (roi*)arg;
+    IplImage *m;
+    float *off;
+    for (;;) {
+        pthread_mutex_lock(&r->lock);
+        while (!r->map && !r->quit) pthread_cond_wait(&r->more, &r->lock);
+        if (!r->map) {
+            pthread_mutex_unlock(&r->lock);
+            break;
+        }
+        m = r->map;
+        off = r->offsets[!r->front]; // the encoder only holds the front
+        pthread_mutex_unlock(&r->lock);
+
+        reduce(r, m, off);
+
+        pthread_mutex_lock(&r->lock);
+        r->map = NULL;
+        r->ready = 1;
+        pthread_cond_broadcast(&r->done);
+        pthread_mutex_unlock(&r->lock);
+    }
+    return NULL;
+}
+
+void roi_new(roi *r, int w, int h, float strength)
+{
+    memset(r, 0, sizeof(*r));
+    r->w = w;
+    r->h = h;
+    r->mb_x = w/16 + (0 != w % 16);
+    r->mb_y = h/16 + (0 != h % 16);
+    r->strength = strength;
+    r->offsets[0] = calloc(r->mb_x*r->mb_y, sizeof(float));
+    r->offsets[1] = calloc(r->mb_x*r->mb_y, sizeof(float));
+    r->sums8 = malloc(r->mb_x*sizeof(uint32_t));
+    r->sumsf = malloc(r->mb_x*sizeof(float));
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->more, NULL);
+    pthread_cond_init(&r->done, NULL);
+    if (!r->offsets[0] || !r->offsets[1] || !r->sums8 || !r->sumsf ||
+        pthread_create(&r->thr, NULL, roi_thr, r)) {
+        fprintf(stderr, "roi: unable to start\n");
+        exit(1);
+    }
+}
+
+void roi_put(roi *r, IplImage *map)
+{
+    if (map->width != r->w || map->height != r->h || map->nChannels != 1 ||
+        (map->depth != IPL_DEPTH_8U && map->depth != IPL_DEPTH_32F)) {
+        fprintf(stderr, "roi: expected a %dx%d 8 bit or float map\n",
+            r->w, r->h);
+        exit(1);
+    }
+    pthread_mutex_lock(&r->lock);
+    while (r->map) pthread_cond_wait(&r->done, &r->lock);
+    r->map = map;
+    pthread_cond_signal(&r->more);
+    pthread_mutex_unlock(&r->lock);
+}
+
+float *roi_get(roi *r)
+{
+    pthread_mutex_lock(&r->lock);
+    while (r->map) pthread_cond_wait(&r->done, &r->lock);
+    if (r->ready) {
+        r->front = !r->front;
+        r->ready = 0;
+    }
+    pthread_mutex_unlock(&r->lock);
+    return r->offsets[r->front];
+}
+
+void roi_free(roi *r)
+{
+    pthread_mutex_lock(&r->lock);
+    r->quit = 1;
+    pthread_cond_signal(&r->more);
+    pthread_mutex_unlock(&r->lock);
+    pthread_join(r->thr, NULL);
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->more);
+    pthread_cond_destroy(&r->done);
+    free(r->offsets[0]);
+    free(r->offsets[1]);
+    free(r->sums8);
+    free(r->sumsf);
+    memset(r, 0, sizeof(*r));
+}
@@ -0,0 +1,44 @@
+#ifndef JOSH_ROI_H
+#define JOSH_ROI_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+// x264 quant_offsets, one per 16x16 macroblock, from a saliency or
+// change map. The map is reduced on a worker thread while the encoder
+// is still busy with the frame before, and the offsets are double
+// buffered: what roi_get hands out stays put until the next roi_get.
+//
+//   roi_put(&r, map[0]);
+//   for each frame i:
+//       pic_in.prop.quant_offsets = roi_get(&r);
+//       roi_put(&r, map[i+1]);
+//       encode frame i
+//
+// motion -r drives it with the frame difference.
+
+typedef struct roi {
+    int w, h;
+    int mb_x, mb_y;
+    float strength;     // offset where nothing is salient; 0 at the most
+    float *offsets[2];
+    int front;          // the set last handed out
+    int ready;          // the other set holds a newer map
+    IplImage *map;      // being reduced; NULL when the worker is idle
+    uint32_t *sums8;    // the worker's per row block sums
+    float *sumsf;
+    int quit;
+    pthread_t thr;
+    pthread_mutex_t lock;
+    pthread_cond_t more, done;
+} roi;
+
+void roi_new(roi *r, int w, int h, float strength);
+// map is 8 bit, or float in [0, 1], of the frame's size. It must stay
+// untouched until the next roi_get. Waits for the map before it.
+void roi_put(roi *r, IplImage *map);
+// Offsets from the map last put, mb_x*mb_y of them; zero before any.
+float *roi_get(roi *r);
+void roi_free(roi *r);
+
+#endif /* JOSH_ROI_H */
@@ -5,12 +5,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <limits.h>
+#include <stdint.h>
 
 #include <opencv2/imgproc/imgproc_c.h>
 #include <opencv2/highgui/highgui_c.h>
 
 #include "kdtree.h"
 #include "prop.h"
+#include "par.h"
 #include "sal.h"
 
 #define XY_TO_INT(x, y) (((y) << 16) | (x))
@@ -58,24 +60,25 @@ static char *name(char *fname)
     return fname;
 }
 
-static double l2_color(int *a, int *b, int k)
+#define SAL_SQRT_BITS 10
+#define SAL_SQRT_TAB (1 << SAL_SQRT_BITS)
+
+typedef struct sal_ctx {
+    kd_tree *t;
+    int mode;                   // SAL_DIST_*
+    int *cx, *cy;               // coordinates of t->points[i]
+    uint16_t sqrt_tab[SAL_SQRT_TAB]; // 16*sqrt(i); integer mode
+    uint32_t recip_tab[SAL_SQRT_TAB]; // 2^24/i
+} sal_ctx;
+
+static int l2_color(int *a, int *b, int k)
 {
     int i, dist = 0;
     for (i = 0; i < k; i++) {
         int diff = a[i] - b[i];
         dist += diff*diff;
     }
-    return sqrt(dist);///sqrt(255*255*k);
-}
-
-static double l2_pos(kd_tree *t, int *a, int *b, int w)
-{
-    int ap = (a - t->start)/t->k;
-    int bp = (b - t->start)/t->k;
-    int ax = ap % w, ay = ap / w;
-    int bx = bp % w, by = bp / w;
-    int dx = ax - bx, dy = ay - by;
-    return sqrt(dx*dx + dy*dy);
+    return dist;
 }
 
 static double clamp(double d)
@@ -85,18 +88,159 @@ static double clamp(double d)
     return d;
 }
 
-static float compute_dist(kd_tree *t, kd_node *n, int *v, int w)
+// Candidate coordinates come from a table that runs parallel to the
+// tree's points, so no divisions by the row width.
+static float dist_exact(sal_ctx *c, kd_node *n, int *v, int x, int y)
+{
+    int i, k = c->t->k, off = n->value - c->t->points;
+    double dist = 0;
+    for (i = 0; i < n->nb; i++) {
+        int dx = c->cx[off + i] - x, dy = c->cy[off + i] - y;
+        double dcolor = sqrt(l2_color(n->value[i], v, k));
+        double dpos = sqrt(dx*dx + dy*dy);
+        dist += dcolor / (1 + k*dpos);
+    }
+    return dist;
+}
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+
+// rsqrt refined by one newton step, about 22 good bits; sqrt(0) is 0
+// rather than 0*inf.
+static inline __m128 fast_sqrt(__m128 x)
+{
+    __m128 y = _mm_rsqrt_ps(x);
+    __m128 xyy = _mm_mul_ps(x, _mm_mul_ps(y, y));
+    y = _mm_mul_ps(y, _mm_sub_ps(_mm_set1_ps(1.5f),
+        _mm_mul_ps(_mm_set1_ps(0.5f), xyy)));
+    return _mm_and_ps(_mm_mul_ps(x, y), _mm_cmpgt_ps(x, _mm_setzero_ps()));
+}
+
+// Squared colour distance of four candidates at once. gck coefficients
+// of 8 bit planes stay within +-16320, so they and their differences
+// fit 16 bits and madd squares and pairs them without overflow.
+static inline __m128i l2_color4(int **u, int *v, int k)
+{
+    __m128i s[4], t0, t1;
+    int i, d;
+    for (i = 0; i < 4; i++) {
+        __m128i acc = _mm_setzero_si128();
+        for (d = 0; d < k; d += 8) {
+            __m128i a = _mm_packs_epi32(_mm_loadu_si128((__m128i*)(u[i] + d)),
+                _mm_loadu_si128((__m128i*)(u[i] + d + 4)));
+            __m128i b = _mm_packs_epi32(_mm_loadu_si128((__m128i*)(v + d)),
+                _mm_loadu_si128((__m128i*)(v + d + 4)));
+            a = _mm_sub_epi16(a, b);
+            acc = _mm_add_epi32(acc, _mm_madd_epi16(a, a));
+        }
+        s[i] = acc;
+    }
+    // transpose-add: lane i ends up with the total of s[i]
+    t0 = _mm_add_epi32(_mm_unpacklo_epi32(s[0], s[1]),
+        _mm_unpackhi_epi32(s[0], s[1]));
+    t1 = _mm_add_epi32(_mm_unpacklo_epi32(s[2], s[3]),
+        _mm_unpackhi_epi32(s[2], s[3]));
+    return _mm_add_epi32(_mm_unpacklo_epi64(t0, t1),
+        _mm_unpackhi_epi64(t0, t1));
+}
+#endif
+
+// Four candidates at a time in single precision. Lanes past the end of
+// the node compare the query against itself and are dropped.
+static float dist_fast(sal_ctx *c, kd_node *n, int *v, int x, int y)
 {
-    int i; double dist = 0;
+    int i, j, k = c->t->k, off = n->value - c->t->points;
+    float dist = 0;
+#ifdef __SSE2__
+    if (!(k & 7)) {
+        const __m128 one = _mm_set1_ps(1), fk = _mm_set1_ps(k);
+        const __m128i qx = _mm_set1_epi32(x), qy = _mm_set1_epi32(y);
+        float r[4];
+        for (i = 0; i < n->nb; i += 4) {
+            int m = n->nb - i < 4 ? n->nb - i : 4, *u[4];
+            for (j = 0; j < 4; j++) u[j] = j < m ? n->value[i + j] : v;
+            __m128 dx = _mm_cvtepi32_ps(_mm_sub_epi32(
+                _mm_loadu_si128((__m128i*)(c->cx + off + i)), qx));
+            __m128 dy = _mm_cvtepi32_ps(_mm_sub_epi32(
+                _mm_loadu_si128((__m128i*)(c->cy + off + i)), qy));
+            __m128 dp = fast_sqrt(_mm_add_ps(_mm_mul_ps(dx, dx),
+                _mm_mul_ps(dy, dy)));
+            __m128 dc = fast_sqrt(_mm_cvtepi32_ps(l2_color4(u, v, k)));
+            _mm_storeu_ps(r, _mm_div_ps(dc,
+                _mm_add_ps(one, _mm_mul_ps(fk, dp))));
+            for (j = 0; j < m; j++) dist += r[j];
+        }
+        return dist;
+    }
+#endif
     for (i = 0; i < n->nb; i++) {
-        int *u = n->value[i];
-        double dcolor = l2_color(u, v, t->k);
-        double dpos = l2_pos(t, u, v, w);
-        dist += dcolor / (1 + t->k*dpos);
+        int dx = c->cx[off + i] - x, dy = c->cy[off + i] - y;
+        float dc = sqrtf(l2_color(n->value[i], v, k));
+        dist += dc/(1 + k*sqrtf(dx*dx + dy*dy));
     }
     return dist;
 }
 
+// 16*sqrt(x) from the top SAL_SQRT_BITS bits of x, under 0.2% off.
+static inline uint32_t isqrt_q4(sal_ctx *c, uint32_t x)
+{
+    int s;
+    if (x < SAL_SQRT_TAB) return c->sqrt_tab[x];
+    s = (32 - __builtin_clz(x) - SAL_SQRT_BITS + 1) & ~1;
+    return (uint32_t)c->sqrt_tab[x >> s] << (s/2);
+}
+
+// 2^24/x the same way, so the ratio is a multiply.
+static inline uint32_t irecip_q24(sal_ctx *c, uint32_t x)
+{
+    int s;
+    if (x < SAL_SQRT_TAB) return c->recip_tab[x];
+    s = 32 - __builtin_clz(x) - SAL_SQRT_BITS;
+    return c->recip_tab[x >> s] >> s;
+}
+
+static inline int64_t ratio_int(sal_ctx *c, uint32_t c2, uint32_t p2, int k)
+{
+    uint32_t dc = isqrt_q4(c, c2), dp = isqrt_q4(c, p2);
+    return (int64_t)dc*irecip_q24(c, 16 + k*dp);
+}
+
+// Roots in Q4 and reciprocals in Q24, both from tables. The Q4 scales
+// cancel in the ratio, leaving the sum in Q24.
+static float dist_int(sal_ctx *c, kd_node *n, int *v, int x, int y)
+{
+    int i, j, k = c->t->k, off = n->value - c->t->points;
+    int64_t dist = 0;
+#ifdef __SSE2__
+    if (!(k & 7)) {
+        uint32_t c2[4];
+        for (i = 0; i < n->nb; i += 4) {
+            int m = n->nb - i < 4 ? n->nb - i : 4, *u[4];
+            for (j = 0; j < 4; j++) u[j] = j < m ? n->value[i + j] : v;
+            _mm_storeu_si128((__m128i*)c2, l2_color4(u, v, k));
+            for (j = 0; j < m; j++) {
+                int dx = c->cx[off + i + j] - x, dy = c->cy[off + i + j] - y;
+                dist += ratio_int(c, c2[j], dx*dx + dy*dy, k);
+            }
+        }
+        return dist/(float)(1 << 24);
+    }
+#endif
+    for (i = 0; i < n->nb; i++) {
+        int dx = c->cx[off + i] - x, dy = c->cy[off + i] - y;
+        dist += ratio_int(c, l2_color(n->value[i], v, k), dx*dx + dy*dy, k);
+    }
+    return dist/(float)(1 << 24);
+}
+
+static float compute_dist(sal_ctx *c, kd_node *n, int *v, int x, int y)
+{
+    if (c->mode == SAL_DIST_EXACT) return dist_exact(c, n, v, x, y);
+    if (c->mode == SAL_DIST_INT) return dist_int(c, n, v, x, y);
+    return dist_fast(c, n, v, x, y);
+}
+
 static void swap2(double *best, kd_node **bestn)
 {
     float d = best[0];
@@ -108,10 +252,10 @@ static void swap2(double *best, kd_node **bestn)
     bestn[1] = n;
 }
 
-static void compute_node(kd_tree *t, double *best, kd_node **bestn,
-    kd_node *n, int *imgc, int *nb, double *dist, int w)
+static void compute_node(sal_ctx *c, double *best, kd_node **bestn,
+    kd_node *n, int *imgc, int *nb, double *dist, int x, int y)
 {
-    double d = compute_dist(t, n, imgc, w);
+    double d = compute_dist(c, n, imgc, x, y);
     *nb += n->nb;
     *dist += d;
     if (d < best[0]) {
@@ -121,21 +265,20 @@ static void compute_node(kd_tree *t, double *best, kd_node **bestn,
     }
 }
 
-static float compute(kd_tree *t, kd_node **nodes, int *imgc,
-    int i, int w)
+static float compute(sal_ctx *c, kd_node **nodes, int *imgc, int x, int y)
 {
-    kd_node *n = kdt_query(t, imgc), *bestn[] = {n, n};
-    double dist = compute_dist(t, n, imgc, w), best[] = {dist, dist};
-    int nb = n->nb, x = i % w, y = i / w;
+    kd_node *n = kdt_query(c->t, imgc), *bestn[] = {n, n};
+    double dist = compute_dist(c, n, imgc, x, y), best[] = {dist, dist};
+    int nb = n->nb;
 
     if (!x) goto try_top;
-    compute_node(t, best, bestn, nodes[-1], imgc, &nb, &dist, w);
-    compute_node(t, best, bestn, nodes[-2], imgc, &nb, &dist, w);
+    compute_node(c, best, bestn, nodes[-1], imgc, &nb, &dist, x, y);
+    compute_node(c, best, bestn, nodes[-2], imgc, &nb, &dist, x, y);
 
 try_top:
     if (!y) goto compute_finish;
-    compute_node(t, best, bestn, nodes[0], imgc, &nb, &dist, w);
-    compute_node(t, best, bestn, nodes[1], imgc, &nb, &dist, w);
+    compute_node(c, best, bestn, nodes[0], imgc, &nb, &dist, x, y);
+    compute_node(c, best, bestn, nodes[1], imgc, &nb, &dist, x, y);
 
 compute_finish:
     nodes[0] = bestn[1];  // max-heap; this is the better match
@@ -143,39 +286,101 @@ compute_finish:
     return 1 - exp(-dist/nb);
 }
 
-static IplImage *salmap(IplImage *img, int free_img)
+static int plane_coeffs[] = {2, 9, 5};
+#define SAL_DIM 16
+
+// The search state of one scale: the tree, the coordinates of its
+// points and, two per column, the best nodes of the last row searched
+// in that column. Video keeps all of it across frames, so a column's
+// first dirty patch starts from whichever row was searched there last,
+// often the bottom of the previous frame rather than the same place.
+typedef struct sal_scale {
+    kd_tree t;
+    sal_ctx ctx;
+    kd_node **nodes;
+    int w, h;   // patch positions
+} sal_scale;
+
+// imgc are the descriptors of an image of size isz; the tree points
+// into them, so they have to outlive the scale.
+static void scale_new(sal_scale *s, CvSize isz, int *imgc, int mode)
 {
-    int plane_coeffs[] = {2, 9, 5}, i, *imgc, *c;
-    int dim = plane_coeffs[0] + plane_coeffs[1] + plane_coeffs[2];
-    CvSize isz = cvGetSize(img);
-    int w = isz.width - 8 + 1, h = isz.height - 8 + 1, sz = w*h;
-    CvSize salsz = {w, h};
-    IplImage *sal = cvCreateImage(salsz, IPL_DEPTH_32F, 1);
-    int salstride = sal->widthStep/sizeof(float);
-    kd_tree kdt;
-    kd_node **nodes = malloc(w*2*sizeof(kd_node*));
-    double min, max;
+    sal_ctx *ctx = &s->ctx;
+    kd_tree *kdt = &s->t;
+    int i;
+
+    s->w = isz.width - 8 + 1;
+    s->h = isz.height - 8 + 1;
+    memset(kdt, 0, sizeof(kd_tree));
+    kdt_new_overlap(kdt, imgc, s->w*s->h, SAL_DIM, 0.5, 8, s->w);
+    s->nodes = calloc(s->w*2, sizeof(kd_node*));
+
+    ctx->t = kdt;
+    ctx->mode = mode;
+    // padded for the four wide loads at the end of a node
+    ctx->cx = calloc(kdt->nb_points + 4, sizeof(int));
+    ctx->cy = calloc(kdt->nb_points + 4, sizeof(int));
+    for (i = 0; i < kdt->nb_points; i++) {
+        int p = (kdt->points[i] - kdt->start)/kdt->k;
+        ctx->cx[i] = p % s->w;
+        ctx->cy[i] = p / s->w;
+    }
+    if (mode == SAL_DIST_INT) {
+        for (i = 0; i < SAL_SQRT_TAB; i++) {
+            ctx->sqrt_tab[i] = 16*sqrt(i) + 0.5;
+            ctx->recip_tab[i] = i ? (1 << 24)/i : 0;
+        }
+    }
+}
 
-    memset(&kdt, 0, sizeof(kd_tree));
-    prop_coeffs(img, plane_coeffs, &imgc);
-    kdt_new_overlap(&kdt, imgc, sz, dim, 0.5, 8, w);
-    c = imgc;
+static void scale_free(sal_scale *s)
+{
+    kdt_free(&s->t);
+    free(s->ctx.cx);
+    free(s->ctx.cy);
+    free(s->nodes);
+    memset(s, 0, sizeof(sal_scale));
+}
 
-    for (i = 0; i < sz; i++) {
-        int x = i % w, y = i / w;
-        float *data = (float*)sal->imageData + (y * salstride + x);
-        *data = compute(&kdt, nodes+x*2, imgc, i, w);
-        imgc += kdt.k;
+// Raw score of every patch of imgc into sal. With dirty, a flag per
+// 8x8 block of the image (bw to a row), only patches whose top left
+// corner is in a flagged block are redone; the rest keep their score.
+static void scale_run(sal_scale *s, int *imgc, IplImage *sal,
+    uint8_t *dirty, int bw)
+{
+    int x, y, k = s->t.k;
+    int salstride = sal->widthStep/sizeof(float);
+    for (y = 0; y < s->h; y++) {
+        float *row = (float*)sal->imageData + y*salstride;
+        for (x = 0; x < s->w; x++) {
+            if (dirty && !dirty[(y/8)*bw + x/8]) continue;
+            row[x] = compute(&s->ctx, s->nodes+x*2,
+                imgc + (y*s->w + x)*k, x, y);
+        }
     }
+}
 
-    kdt_free(&kdt);
-    free(nodes);
-    free(c);
-    if (free_img) cvReleaseImage(&img);
-    cvMinMaxLoc(sal, &min, &max, NULL, NULL, NULL);
+// rescale src into [0, 1], into dst; in place is fine
+static void normalize(IplImage *src, IplImage *dst)
+{
+    double min, max;
+    cvMinMaxLoc(src, &min, &max, NULL, NULL, NULL);
     CvScalar scalar = cvRealScalar(-min);
-    cvAddS(sal, scalar, sal, NULL);
-    cvConvertScale(sal, sal, 1.0/(max - min), 0);
+    cvAddS(src, scalar, dst, NULL);
+    cvConvertScale(dst, dst, 1.0/(max - min), 0);
+}
+
+// scores of every patch, stretched to [0, 1] with norm
+static IplImage *salmap(CvSize isz, int *imgc, int mode, int norm)
+{
+    sal_scale s;
+    IplImage *sal;
+    scale_new(&s, isz, imgc, mode);
+    CvSize salsz = {s.w, s.h};
+    sal = cvCreateImage(salsz, IPL_DEPTH_32F, 1);
+    scale_run(&s, imgc, sal, NULL, 0);
+    scale_free(&s);
+    if (norm) normalize(sal, sal);
     return sal;
 }
 
@@ -202,50 +407,204 @@ static void write2file(char *fname, IplImage *img)
     cvReleaseImage(&out);
 }
 
-static float attended_scale(IplImage *thresh, int x, int y)
+#define SAL_DISK 32   // attended scale window
+#define SAL_LEVELS 10 // thresholds 0.5, 0.6 .. 1.4 on the mean map
+
+typedef struct distmap_job {
+    uint8_t *levels;            // thresholds each pixel is above
+    int w, h;
+    int b0[SAL_DISK], b1[SAL_DISK];  // disk columns per row
+    double wt[SAL_DISK][SAL_DISK];   // distance from the centre
+    IplImage *distmap;
+    int *x0, *x1;               // columns to redo per row; NULL for all
+    int nb;
+} distmap_job;
+
+// Sum over the ten thresholds of the attended scale: the disk around
+// (x, y), weighted by distance from the centre, counting pixels above
+// the threshold. A pixel above threshold i is above every lower one, so
+// one scan of the disk feeds all ten sums, in the same order the
+// per-threshold scans did. The radial weight is not box separable, so
+// this stays a disk scan, with table weights instead of sqrt.
+static float attended_scale(distmap_job *j, int x, int y)
 {
-    int d = 32;
-    double r = d/2;
-    if (x+r >= thresh->width) return 0.5; // lazy; fix later
-    if (y+r >= thresh->height) return 0.5;
+    int d = SAL_DISK, a, b, i;
+    double r = d/2, dist[SAL_LEVELS];
+    int count[SAL_LEVELS];
+    float sum = 0;
+    if (x+r >= j->w) return 0.5*SAL_LEVELS; // lazy; fix later
+    if (y+r >= j->h) return 0.5*SAL_LEVELS;
 
-    int s = thresh->widthStep/sizeof(float), a, b;
     int startx = abs((x - r)), starty = abs((y - r));
-    float *f = (float*)thresh->imageData + (starty*s + startx);
-    double dist = 0;
-    int count = 0;
+    uint8_t *f = j->levels + (starty*j->w + startx);
+    for (i = 0; i < SAL_LEVELS; i++) {
+        dist[i] = 0;
+        count[i] = 0;
+    }
     for (a = 0; a < d; a++) {
-        float *g = f + s*a;
-        for (b = 0; b < d; b++) {
-            double ed = (a - r)*(a - r) + (b - r)*(b - r);
-            if (ed < r*r) {
-                if (*g > 0) {
-                    dist += sqrt(ed);
-                    count++;
-                }
+        uint8_t *g = f + j->w*a;
+        for (b = j->b0[a]; b < j->b1[a]; b++) {
+            int l = g[b];
+            double wt = j->wt[a][b];
+            if (!l) continue;
+            for (i = 0; i < SAL_LEVELS; i++) {
+                dist[i] += i < l ? wt : 0;
+                count[i] += i < l;
             }
-            g++;
         }
     }
-    if (count) return (count*dist)/((r*r)*sqrt(2*r*r));
-    return 0.0;
+    for (i = 0; i < SAL_LEVELS; i++) {
+        if (count[i]) sum += (float)((count[i]*dist[i])/((r*r)*sqrt(2*r*r)));
+    }
+    return sum;
 }
 
-static IplImage* calc_distmap(IplImage *thresh)
+// rows dealt round-robin, so a cluster of redone rows still spreads
+static void distmap_thr(void *arg, int id)
 {
-    IplImage *distmap = cvCreateImage(cvGetSize(thresh), thresh->depth, 1);
+    distmap_job *j = (distmap_job*)arg;
     int x, y;
-    float *data; int stride = thresh->widthStep/sizeof(float);
-    for (y = 0; y < thresh->height; y++) {
-        data = (float*)distmap->imageData + y * stride;
-        for (x = 0; x < thresh->width; x++) {
-            data[x] = attended_scale(thresh, x, y);
+    float *data; int stride = j->distmap->widthStep/sizeof(float);
+    for (y = id; y < j->h; y += j->nb) {
+        int x0 = j->x0 ? j->x0[y] : 0, x1 = j->x0 ? j->x1[y] : j->w;
+        data = (float*)j->distmap->imageData + y * stride;
+        for (x = x0; x < x1; x++) {
+            data[x] = attended_scale(j, x, y);
+        }
+    }
+}
+
+static void distmap_setup(distmap_job *j, int w, int h)
+{
+    int r = SAL_DISK/2, x, y;
+    for (y = 0; y < SAL_DISK; y++) {
+        j->b0[y] = SAL_DISK;
+        j->b1[y] = 0;
+        for (x = 0; x < SAL_DISK; x++) {
+            int ed = (y - r)*(y - r) + (x - r)*(x - r);
+            j->wt[y][x] = sqrt(ed);
+            if (ed >= r*r) continue;
+            if (x < j->b0[y]) j->b0[y] = x;
+            j->b1[y] = x + 1;
+        }
+    }
+    j->w = w;
+    j->h = h;
+    j->x0 = j->x1 = NULL;
+}
+
+// disks near the edges reach past the map; those read zeros
+static uint8_t *levels_alloc(int w, int h)
+{
+    return calloc((size_t)(h + SAL_DISK)*w + SAL_DISK, 1);
+}
+
+// Into l, the thresholds each pixel of row y of mean is above. Returns
+// the columns that differ from what l held as [*x0, *x1), empty if none.
+static void mean_levels(IplImage *mean, int y, uint8_t *l, int *x0, int *x1)
+{
+    float *m = (float*)(mean->imageData + y*mean->widthStep);
+    float thresh[SAL_LEVELS];
+    int x, i;
+    // thresholding a float image compares in float
+    for (i = 0; i < SAL_LEVELS; i++) thresh[i] = 0.5 + 0.1*i;
+    *x0 = mean->width;
+    *x1 = 0;
+    for (x = 0; x < mean->width; x++) {
+        for (i = 0; i < SAL_LEVELS && m[x] > thresh[i]; i++);
+        if (l[x] == i) continue;
+        l[x] = i;
+        if (x < *x0) *x0 = x;
+        *x1 = x + 1;
+    }
+}
+
+// Attended scale of the mean map summed over every threshold; rows on
+// every cpu.
+static void calc_distmap(IplImage *mean, IplImage *distmap, int nb_threads)
+{
+    distmap_job j;
+    int w = mean->width, h = mean->height, y, x0, x1;
+    j.levels = levels_alloc(w, h);
+    for (y = 0; y < h; y++) mean_levels(mean, y, j.levels + y*w, &x0, &x1);
+    distmap_setup(&j, w, h);
+    j.distmap = distmap;
+    j.nb = par_threads(nb_threads);
+    if (j.nb > h) j.nb = h;
+    par_run(j.nb, distmap_thr, &j);
+    free(j.levels);
+}
+
+// The attended scale carried from one video frame to the next: the
+// last frame's levels and sums. A sum only reads the levels under its
+// disk, so only those whose disk covers a level that changed are redone,
+// and the result is the same as calc_distmap's.
+typedef struct sal_attend {
+    uint8_t *levels;
+    IplImage *dist;
+    int *cx0, *cx1;     // level columns that changed, per row
+    int *x0, *x1;       // sums to redo, per row
+} sal_attend;
+
+static void attend_free(sal_attend *a)
+{
+    free(a->levels);
+    free(a->cx0);
+    cvReleaseImage(&a->dist);
+    memset(a, 0, sizeof(sal_attend));
+}
+
+static IplImage *attend_update(sal_attend *a, IplImage *mean, int nb_threads)
+{
+    distmap_job j;
+    int w = mean->width, h = mean->height, r = SAL_DISK/2, x, y, i;
+    int full = !a->dist || w < 3*r; // narrower, disks wrap into next rows
+    if (!a->dist) {
+        a->levels = levels_alloc(w, h);
+        a->dist = cvCreateImage(cvGetSize(mean), IPL_DEPTH_32F, 1);
+        a->cx0 = malloc(4*h*sizeof(int));
+        if (!a->levels || !a->cx0) {
+            fprintf(stderr, "sal: unable to allocate attended scale\n");
+            exit(1);
+        }
+        a->cx1 = a->cx0 + h;
+        a->x0 = a->cx1 + h;
+        a->x1 = a->x0 + h;
+    }
+    for (y = 0; y < h; y++)
+        mean_levels(mean, y, a->levels + y*w, &a->cx0[y], &a->cx1[y]);
+    // the disk at (x, y) reads rows |y - r| on and columns |x - r| on,
+    // SAL_DISK of each; see attended_scale
+    for (y = 0; y < h; y++) {
+        int s = abs(y - r), u0 = w, u1 = 0, lo = w, hi = 0;
+        for (i = s; i < s + SAL_DISK && i < h; i++) {
+            if (a->cx0[i] < u0) u0 = a->cx0[i];
+            if (a->cx1[i] > u1) u1 = a->cx1[i];
+        }
+        for (x = 0; x < w && u0 < u1; x++) {
+            int sx = abs(x - r);
+            if (sx >= u1 || sx + SAL_DISK <= u0) continue;
+            if (x < lo) lo = x;
+            hi = x + 1;
         }
+        a->x0[y] = full ? 0 : lo;
+        a->x1[y] = full ? w : hi;
     }
-    return distmap;
+    distmap_setup(&j, w, h);
+    j.levels = a->levels;
+    j.distmap = a->dist;
+    j.x0 = a->x0;
+    j.x1 = a->x1;
+    j.nb = par_threads(nb_threads);
+    if (j.nb > h) j.nb = h;
+    par_run(j.nb, distmap_thr, &j);
+    return a->dist;
 }
 
-static IplImage* combine(IplImage** maps, int nb)
+// With a, the attended scale is updated from the last call's instead of
+// computed afresh.
+static IplImage* combine(IplImage** maps, int nb, int nb_threads,
+    sal_attend *a)
 {
     int i;
     double min, max;
@@ -253,7 +612,6 @@ static IplImage* combine(IplImage** maps, int nb)
     CvSize sz = cvGetSize(img);
     IplImage *sum = alignedImage(sz, img->depth, img->nChannels, 8);
     IplImage *mean = alignedImage(sz, img->depth, img->nChannels, 8);
-    IplImage *thr = alignedImage(sz, img->depth, 1, 8);
     cvXor(sum, sum, sum, NULL);
     for (i = 0; i < nb; i++) {
         IplImage *s1 = maps[i];
@@ -262,41 +620,488 @@ static IplImage* combine(IplImage** maps, int nb)
         cvReleaseImage(&r);
     }
     cvConvertScale(sum, mean, 1.0/nb, 0);
-    cvXor(sum, sum, sum, NULL);
-    for (i = 0; i < 10; i++) {
-        cvThreshold(mean, thr, 0.5 + 0.1*i, 0.0, CV_THRESH_TOZERO);
-        IplImage *dist = calc_distmap(thr);
-        cvAcc(dist, sum, NULL);
-        cvReleaseImage(&dist);
+    if (a) cvConvertScale(attend_update(a, mean, nb_threads), sum,
+        1.0/SAL_LEVELS, 0);
+    else {
+        calc_distmap(mean, sum, nb_threads);
+        cvConvertScale(sum, sum, 1.0/SAL_LEVELS, 0);
     }
-    cvConvertScale(sum, sum, 1.0/10, 0);
     cvMinMaxLoc(sum, &min, &max, NULL, NULL, NULL);
     CvScalar scalar = cvRealScalar(-min);
     cvAddS(sum, scalar, sum, NULL);
     cvConvertScale(sum, sum, 1.0/(max - min), 0);
     cvMul(sum, mean, mean, 1);
     cvReleaseImage(&sum);
-    cvReleaseImage(&thr);
     return mean;
 }
 
-IplImage* saliency(IplImage *img)
+#define SAL_SCALES 4
+static const float sal_scales[SAL_SCALES] = {1.0, 0.8, 0.5, 0.25};
+
+// Every scale resized from the original once, and the descriptors of
+// all of them in one allocation, computed largest first through one
+// scratch so the smaller levels reuse its buffers.
+typedef struct sal_pyr {
+    IplImage *imgs[SAL_SCALES]; // 0 is the caller's
+    int *coeffs[SAL_SCALES];
+    int *data;
+    prop_scratch s;
+} sal_pyr;
+
+static void sal_pyr_coeffs(sal_pyr *p)
 {
-    IplImage *s1 = salmap(img, 0);
-    IplImage *s2 = salmap(resize(img, 0.8), 1);
-    IplImage *s3 = salmap(resize(img, 0.5), 1);
-    IplImage *s4 = salmap(resize(img, 0.25), 1);
-    IplImage *scales[] = { s1, s2, s3, s4 };
-    IplImage *sal = combine(scales, sizeof(scales)/sizeof(IplImage*));
-    IplImage *res = resize2(sal, cvGetSize(img));
-    cvReleaseImage(&s1);
-    cvReleaseImage(&s2);
-    cvReleaseImage(&s3);
-    cvReleaseImage(&s4);
+    int i;
+    for (i = 0; i < SAL_SCALES; i++)
+        prop_coeffs_into(p->imgs[i], plane_coeffs, p->coeffs[i], &p->s);
+}
+
+static void sal_pyr_new(sal_pyr *p, IplImage *img)
+{
+    size_t off[SAL_SCALES], total = 0;
+    int i;
+    memset(p, 0, sizeof(sal_pyr));
+    p->imgs[0] = img;
+    for (i = 1; i < SAL_SCALES; i++) p->imgs[i] = resize(img, sal_scales[i]);
+    for (i = 0; i < SAL_SCALES; i++) {
+        off[i] = total;
+        total += (size_t)(p->imgs[i]->width - 8 + 1)*
+            (p->imgs[i]->height - 8 + 1)*SAL_DIM;
+    }
+    p->data = malloc(total*sizeof(int));
+    if (!p->data) {
+        fprintf(stderr, "sal: unable to allocate descriptors\n");
+        exit(1);
+    }
+    for (i = 0; i < SAL_SCALES; i++) p->coeffs[i] = p->data + off[i];
+    sal_pyr_coeffs(p);
+}
+
+// next frame, same size as the one p was made for
+static void sal_pyr_update(sal_pyr *p, IplImage *img)
+{
+    int i;
+    p->imgs[0] = img;
+    for (i = 1; i < SAL_SCALES; i++) cvResize(img, p->imgs[i], CV_INTER_CUBIC);
+    sal_pyr_coeffs(p);
+}
+
+static void sal_pyr_free(sal_pyr *p)
+{
+    int i;
+    for (i = 1; i < SAL_SCALES; i++) cvReleaseImage(&p->imgs[i]);
+    free(p->data);
+    prop_scratch_free(&p->s);
+    memset(p, 0, sizeof(sal_pyr));
+}
+
+typedef struct scale_job {
+    sal_pyr *pyr;
+    int mode;
+    int raw;    // leave the scores unnormalized
+    int nb;
+    IplImage *maps[SAL_SCALES];
+} scale_job;
+
+// The scales only read the pyramid, so each gets a thread, up to
+// nb_threads of them.
+static int scale_threads(int nb_threads)
+{
+    int nb = par_threads(nb_threads);
+    return nb < SAL_SCALES ? nb : SAL_SCALES;
+}
+
+static void scale_thr(void *arg, int id)
+{
+    scale_job *j = (scale_job*)arg;
+    int i;
+    for (i = id; i < SAL_SCALES; i += j->nb) {
+        j->maps[i] = salmap(cvGetSize(j->pyr->imgs[i]), j->pyr->coeffs[i],
+            j->mode, !j->raw);
+    }
+}
+
+static void scale_maps(IplImage *img, sal_opts *opts, int raw,
+    IplImage **maps)
+{
+    scale_job j;
+    sal_pyr pyr;
+    int i;
+    sal_pyr_new(&pyr, img);
+    j.pyr = &pyr;
+    j.mode = opts->dist;
+    j.raw = raw;
+    j.nb = scale_threads(opts->nb_threads);
+    par_run(j.nb, scale_thr, &j);
+    sal_pyr_free(&pyr);
+    for (i = 0; i < SAL_SCALES; i++) maps[i] = j.maps[i];
+}
+
+// combined normalized scales, at size sz; releases the maps
+static IplImage *scale_finish(IplImage **maps, CvSize sz, int nb_threads)
+{
+    int i;
+    IplImage *sal = combine(maps, SAL_SCALES, nb_threads, NULL);
+    IplImage *res = resize2(sal, sz);
+    for (i = 0; i < SAL_SCALES; i++) cvReleaseImage(&maps[i]);
     cvReleaseImage(&sal);
     return res;
 }
 
+static IplImage *saliency_whole(IplImage *img, sal_opts *opts)
+{
+    IplImage *maps[SAL_SCALES];
+    scale_maps(img, opts, 0, maps);
+    return scale_finish(maps, cvGetSize(img), opts->nb_threads);
+}
+
+#define SAL_HALO SAL_DISK   // context around a tile, each side
+
+// Weight of a tile at x, along one axis. The core is [lo, hi); toward
+// a neighbour the weight ramps over the 2*halo the two tiles share and
+// the neighbour's ramp is the complement, so weights always sum to 1.
+static float feather(int x, int lo, int hi, int first, int last)
+{
+    if (!first && x < lo + SAL_HALO)
+        return (x - (lo - SAL_HALO) + 0.5f)/(2*SAL_HALO);
+    if (!last && x >= hi - SAL_HALO)
+        return ((hi + SAL_HALO) - x - 0.5f)/(2*SAL_HALO);
+    return 1;
+}
+
+// Tile edges along one axis, multiples of 8 and no closer together
+// than tile. Returns the number of tiles; edges has one more entry.
+static int tile_edges(int len, int tile, int *edges)
+{
+    int i, n = len/tile;
+    if (n < 1) n = 1;
+    for (i = 0; i < n; i++) edges[i] = (int)((int64_t)len*i/n) & ~7;
+    edges[n] = len;
+    return n;
+}
+
+// size of scale i of an image of size sz, as sal_pyr_new makes it
+static CvSize level_size(CvSize sz, int i)
+{
+    CvSize l = {sz.width*sal_scales[i], sz.height*sal_scales[i]};
+    if (!i) return sz;
+    l.width = (l.width + 7) & ~7;
+    l.height = (l.height + 7) & ~7;
+    return l;
+}
+
+typedef struct sal_tile {
+    int x0, y0, x1, y1;     // crop, clipped to the image
+    int lo[2], hi[2];       // core, x then y
+    int first[2], last[2];
+    CvSize crop;            // padded crop size
+} sal_tile;
+
+// Feathers the raw scores t of one scale of a tile into the map g of
+// the same scale of the whole image of size isz. Each pixel of g takes
+// the tile's score nearest to where it falls in the crop.
+static void tile_paste(IplImage *g, IplImage *t, sal_tile *tl, CvSize isz,
+    CvSize tlsz)
+{
+    int gw = g->width + 7, gh = g->height + 7;  // level sizes
+    int gx0 = (int64_t)tl->x0*gw/isz.width, gx1 = (int64_t)tl->x1*gw/isz.width + 1;
+    int gy0 = (int64_t)tl->y0*gh/isz.height, gy1 = (int64_t)tl->y1*gh/isz.height + 1;
+    int gx, gy;
+    if (gx1 > g->width) gx1 = g->width;
+    if (gy1 > g->height) gy1 = g->height;
+    for (gy = gy0; gy < gy1; gy++) {
+        int Y = (int64_t)gy*isz.height/gh, q;
+        float wy, *dst = (float*)(g->imageData + gy*g->widthStep), *src;
+        if (Y < tl->y0 || Y >= tl->y1) continue;
+        wy = feather(Y, tl->lo[1], tl->hi[1], tl->first[1], tl->last[1]);
+        q = (int64_t)(Y - tl->y0)*tlsz.height/tl->crop.height;
+        if (q >= t->height) q = t->height - 1;
+        src = (float*)(t->imageData + q*t->widthStep);
+        for (gx = gx0; gx < gx1; gx++) {
+            int X = (int64_t)gx*isz.width/gw, p;
+            if (X < tl->x0 || X >= tl->x1) continue;
+            p = (int64_t)(X - tl->x0)*tlsz.width/tl->crop.width;
+            if (p >= t->width) p = t->width - 1;
+            dst[gx] += wy*feather(X, tl->lo[0], tl->hi[0], tl->first[0],
+                tl->last[0])*src[p];
+        }
+    }
+}
+
+// Each tile, with a halo of context, gets its own pyramid and trees.
+// Their raw scores, not yet stretched to [0, 1], are feathered over
+// the halos into per scale maps of the whole image, which are then
+// normalized and combined as one. Only one tile's descriptors and
+// trees are alive at a time. The scale maps (about 2 floats a pixel)
+// and the combine's sum, mean, resized scale and levels still cover the
+// whole image, so memory is bounded per pixel, not overall.
+static IplImage *saliency_tiled(IplImage *img, sal_opts *opts, int tile)
+{
+    int W = img->width, H = img->height;
+    int nx, ny, tx, ty, y, i;
+    int *ex = malloc((W/tile + 2)*sizeof(int));
+    int *ey = malloc((H/tile + 2)*sizeof(int));
+    IplImage *maps[SAL_SCALES], *tmaps[SAL_SCALES];
+    CvSize isz = cvGetSize(img);
+    sal_tile tl;
+
+    for (i = 0; i < SAL_SCALES; i++) {
+        CvSize l = level_size(isz, i), m = {l.width - 8 + 1, l.height - 8 + 1};
+        maps[i] = cvCreateImage(m, IPL_DEPTH_32F, 1);
+        cvSetZero(maps[i]);
+    }
+    nx = tile_edges(W, tile, ex);
+    ny = tile_edges(H, tile, ey);
+    for (ty = 0; ty < ny; ty++) {
+        for (tx = 0; tx < nx; tx++) {
+            IplImage *crop;
+            tl.lo[0] = ex[tx];
+            tl.hi[0] = ex[tx+1];
+            tl.lo[1] = ey[ty];
+            tl.hi[1] = ey[ty+1];
+            tl.first[0] = !tx;
+            tl.last[0] = tx == nx-1;
+            tl.first[1] = !ty;
+            tl.last[1] = ty == ny-1;
+            tl.x0 = tl.lo[0] - SAL_HALO < 0 ? 0 : tl.lo[0] - SAL_HALO;
+            tl.y0 = tl.lo[1] - SAL_HALO < 0 ? 0 : tl.lo[1] - SAL_HALO;
+            tl.x1 = tl.hi[0] + SAL_HALO > W ? W : tl.hi[0] + SAL_HALO;
+            tl.y1 = tl.hi[1] + SAL_HALO > H ? H : tl.hi[1] + SAL_HALO;
+            CvSize sz = {tl.x1 - tl.x0, tl.y1 - tl.y0};
+            crop = alignedImage(sz, img->depth, img->nChannels, 8);
+            cvSetZero(crop);
+            tl.crop = cvGetSize(crop);
+            for (y = tl.y0; y < tl.y1; y++) {
+                memcpy(crop->imageData + (y - tl.y0)*crop->widthStep,
+                    img->imageData + y*img->widthStep + tl.x0*img->nChannels,
+                    sz.width*img->nChannels);
+            }
+            scale_maps(crop, opts, 1, tmaps);
+            for (i = 0; i < SAL_SCALES; i++) {
+                tile_paste(maps[i], tmaps[i], &tl, isz,
+                    level_size(tl.crop, i));
+                cvReleaseImage(&tmaps[i]);
+            }
+            cvReleaseImage(&crop);
+        }
+    }
+    free(ex);
+    free(ey);
+    for (i = 0; i < SAL_SCALES; i++) normalize(maps[i], maps[i]);
+    return scale_finish(maps, isz, opts->nb_threads);
+}
+
+IplImage* saliency_opts(IplImage *img, sal_opts *opts)
+{
+    sal_opts def;
+    int tile;
+    if (!opts) {
+        memset(&def, 0, sizeof(sal_opts));
+        opts = &def;
+    }
+    tile = opts->tile;
+    if (tile > 0 && (tile < img->width || tile < img->height)) {
+        // at least room for the ramps on both sides
+        if (tile < 4*SAL_HALO) tile = 4*SAL_HALO;
+        return saliency_tiled(img, opts, tile);
+    }
+    return saliency_whole(img, opts);
+}
+
+IplImage* saliency(IplImage *img)
+{
+    return saliency_opts(img, NULL);
+}
+
+// Per scale video state. The tree is built on a copy of the descriptors
+// of the frame it was made on and only rebuilt every refresh frames or
+// on a scene cut; in between, patches are matched against that frame.
+typedef struct sal_vscale {
+    sal_scale sc;
+    int *ref;           // descriptors the tree points into
+    IplImage *prev;     // the scale's image last frame
+    IplImage *raw;      // unnormalized scores, kept where nothing changed
+    IplImage *map;      // normalized, for combine
+    uint8_t *dirty;     // per 8x8 block of the image
+    int bw, bh;
+    int changed;        // blocks that changed this frame
+} sal_vscale;
+
+// Mean absolute difference per sample of each 8x8 block against the
+// last frame. A patch starting in a block also covers the blocks to
+// its right and below, so a block is dirty if it or one of those
+// changed. Returns the number of blocks that changed.
+static int mark_changes(sal_vscale *v, IplImage *img, int thresh)
+{
+    int bx, by, x, y, changed = 0;
+    int limit = thresh*8*8*3;
+    uint8_t *c = v->dirty;
+    for (by = 0; by < v->bh; by++) {
+        for (bx = 0; bx < v->bw; bx++) {
+            int sad = 0, ye = by*8 + 8, xe = bx*8 + 8;
+            if (ye > img->height) ye = img->height;
+            if (xe > img->width) xe = img->width;
+            for (y = by*8; y < ye; y++) {
+                uint8_t *a = (uint8_t*)img->imageData + y*img->widthStep;
+                uint8_t *b = (uint8_t*)v->prev->imageData + y*v->prev->widthStep;
+                for (x = bx*8*3; x < xe*3; x++) sad += abs(a[x] - b[x]);
+            }
+            c[by*v->bw + bx] = sad > limit;
+            changed += sad > limit;
+        }
+    }
+    // spread up and left, in place: each block only looks at later ones
+    for (by = 0; by < v->bh; by++) {
+        for (bx = 0; bx < v->bw; bx++) {
+            uint8_t *d = c + by*v->bw + bx;
+            int r = bx + 1 < v->bw, b = by + 1 < v->bh;
+            if (r) *d |= d[1];
+            if (b) *d |= d[v->bw];
+            if (r && b) *d |= d[v->bw + 1];
+        }
+    }
+    return changed;
+}
+
+static void vscale_build(sal_vscale *v, IplImage *img, int *coeffs, int mode)
+{
+    CvSize isz = cvGetSize(img);
+    size_t n = (size_t)(isz.width - 8 + 1)*(isz.height - 8 + 1)*SAL_DIM;
+    if (v->ref) scale_free(&v->sc);
+    else v->ref = malloc(n*sizeof(int));
+    if (!v->ref) {
+        fprintf(stderr, "sal: unable to allocate video descriptors\n");
+        exit(1);
+    }
+    memcpy(v->ref, coeffs, n*sizeof(int));
+    scale_new(&v->sc, isz, v->ref, mode);
+}
+
+static void vscale_new(sal_vscale *v, IplImage *img, int *coeffs, int mode)
+{
+    CvSize isz = cvGetSize(img);
+    memset(v, 0, sizeof(sal_vscale));
+    vscale_build(v, img, coeffs, mode);
+    CvSize salsz = {v->sc.w, v->sc.h};
+    v->raw = cvCreateImage(salsz, IPL_DEPTH_32F, 1);
+    v->map = cvCreateImage(salsz, IPL_DEPTH_32F, 1);
+    v->prev = cvCreateImage(isz, IPL_DEPTH_8U, 3);
+    v->bw = (isz.width + 7)/8;
+    v->bh = (isz.height + 7)/8;
+    v->dirty = malloc(v->bw*v->bh);
+}
+
+static void vscale_free(sal_vscale *v)
+{
+    scale_free(&v->sc);
+    free(v->ref);
+    free(v->dirty);
+    cvReleaseImage(&v->prev);
+    cvReleaseImage(&v->raw);
+    cvReleaseImage(&v->map);
+    memset(v, 0, sizeof(sal_vscale));
+}
+
+typedef struct video_job {
+    sal_video *v;
+    int full;   // redo every patch; the trees were just rebuilt
+    int nb;
+} video_job;
+
+static void video_thr(void *arg, int id)
+{
+    video_job *j = (video_job*)arg;
+    int i;
+    for (i = id; i < SAL_SCALES; i += j->nb) {
+        sal_vscale *v = &j->v->scales[i];
+        IplImage *img = j->v->pyr->imgs[i];
+        int *coeffs = j->v->pyr->coeffs[i];
+        if (j->full) scale_run(&v->sc, coeffs, v->raw, NULL, 0);
+        else if (v->changed)
+            scale_run(&v->sc, coeffs, v->raw, v->dirty, v->bw);
+        normalize(v->raw, v->map);
+        cvCopy(img, v->prev, NULL);
+    }
+}
+
+static void video_reset(sal_video *v)
+{
+    int i;
+    if (v->scales) {
+        for (i = 0; i < SAL_SCALES; i++) vscale_free(&v->scales[i]);
+        sal_pyr_free(v->pyr);
+    }
+    if (v->attend) attend_free(v->attend);
+    free(v->scales);
+    free(v->pyr);
+    free(v->attend);
+    cvReleaseImage(&v->avg);
+    v->scales = NULL;
+    v->pyr = NULL;
+    v->attend = NULL;
+    v->frame = 0;
+}
+
+void sal_video_new(sal_video *v, sal_opts *opts)
+{
+    memset(v, 0, sizeof(sal_video));
+    if (opts) v->opts = *opts;
+    v->alpha = 0.3;
+    v->thresh = 6;
+    v->refresh = 60;
+    v->cut = 0.5;
+}
+
+IplImage *sal_video_frame(sal_video *v, IplImage *img)
+{
+    video_job j;
+    IplImage *maps[SAL_SCALES], *sal, *res;
+    int i, mode = v->opts.dist;
+
+    if (v->avg && (img->width != v->avg->width ||
+        img->height != v->avg->height)) video_reset(v);
+    j.v = v;
+    j.full = 1;
+    if (!v->scales) {
+        v->pyr = malloc(sizeof(sal_pyr));
+        v->scales = malloc(SAL_SCALES*sizeof(sal_vscale));
+        v->attend = calloc(1, sizeof(sal_attend));
+        sal_pyr_new(v->pyr, img);
+        for (i = 0; i < SAL_SCALES; i++)
+            vscale_new(&v->scales[i], v->pyr->imgs[i], v->pyr->coeffs[i], mode);
+    } else {
+        sal_pyr_update(v->pyr, img);
+        for (i = 0; i < SAL_SCALES; i++)
+            v->scales[i].changed = mark_changes(&v->scales[i],
+                v->pyr->imgs[i], v->thresh);
+        j.full = ++v->frame >= v->refresh ||
+            v->scales[0].changed > v->cut*v->scales[0].bw*v->scales[0].bh;
+        if (j.full) {
+            for (i = 0; i < SAL_SCALES; i++)
+                vscale_build(&v->scales[i], v->pyr->imgs[i],
+                    v->pyr->coeffs[i], mode);
+            v->frame = 0;
+        }
+    }
+    j.nb = scale_threads(v->opts.nb_threads);
+    par_run(j.nb, video_thr, &j);
+
+    for (i = 0; i < SAL_SCALES; i++) maps[i] = v->scales[i].map;
+    sal = combine(maps, SAL_SCALES, v->opts.nb_threads, v->attend);
+    res = resize2(sal, cvGetSize(img));
+    cvReleaseImage(&sal);
+    if (!v->avg) v->avg = res;
+    else {
+        cvRunningAvg(res, v->avg, v->alpha, NULL);
+        cvReleaseImage(&res);
+    }
+    return v->avg;
+}
+
+void sal_video_free(sal_video *v)
+{
+    video_reset(v);
+}
+
 #if 0
 int main(int argc, char **argv)
 {
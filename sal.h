@@ -1,6 +1,49 @@
 #ifndef JOSH_SALIENCY_H
 #define JOSH_SALIENCY_H
 
+// zero-initialize for defaults
+typedef struct sal_opts {
+    int dist;   // SAL_DIST_*; how the patch distances are taken
+    int tile;   // > 0 works in tiles about this wide, for very large
+                // images; 0 takes the whole image at once. Tiling keeps
+                // descriptors and trees to one tile's worth, but the
+                // per scale maps and combining them still grow with the
+                // image: about 19 bytes a pixel at peak, image and
+                // result included, against about 190 untiled.
+    int nb_threads; // <= 0 uses every cpu
+} sal_opts;
+
+#define SAL_DIST_FAST  0 // single precision, rsqrt plus a newton step
+#define SAL_DIST_EXACT 1 // double precision sqrt
+#define SAL_DIST_INT   2 // integer only: table roots and reciprocals
+
 IplImage *saliency(IplImage *img);
+IplImage *saliency_opts(IplImage *img, sal_opts *opts);
+
+// Video saliency. Each scale keeps its tree, built on an earlier frame,
+// and the search state of the last one; only the patches over blocks
+// that changed are scored again, the attended scale is only summed again
+// where its disk covers a change, and the map is a running average over
+// frames. motion -s feeds it to the encoder through roi. Set the
+// tunables after sal_video_new.
+typedef struct sal_video {
+    sal_opts opts;
+    float alpha;    // weight of the newest frame in the average; 0.3
+    int thresh;     // mean absolute change that marks a block; 6
+    int refresh;    // rebuild the trees every this many frames; 60
+    float cut;      // or once this share of blocks changed; 0.5
+
+    int frame;      // since the trees were built
+    struct sal_pyr *pyr;
+    struct sal_vscale *scales;
+    struct sal_attend *attend;
+    IplImage *avg;
+} sal_video;
+
+void sal_video_new(sal_video *v, sal_opts *opts);
+// The returned map belongs to v and is overwritten by the next frame.
+// Frames of another size start over.
+IplImage *sal_video_frame(sal_video *v, IplImage *img);
+void sal_video_free(sal_video *v);
 
 #endif /*JOSH_SALIENCY_H*/
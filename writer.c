@@ -0,0 +1,126 @@
+// Asynchronous mask output.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <opencv2/imgproc/imgproc_c.h>
+#include <opencv2/highgui/highgui_c.h>
+
+#include "writer.h"
+
+static void write_file(writer *w, writer_item *it)
+{
+    IplImage *m = it->mask;
+    if (!w->mf_open) {
+        int codec = w->mode == WRITER_RLE ? MASK_RLE : MASK_RAW;
+        if (maskfile_create(&w->mf, w->out, it->orig.width,
+            it->orig.height, codec)) exit(1);
+        w->mf_open = 1;
+    }
+    if (maskfile_append(&w->mf, it->frame, (uint8_t*)m->imageData,
+        m->widthStep)) exit(1);
+}
+
+static void write_png(writer *w, writer_item *it)
+{
+    char name[1024];
+    IplImage *m = it->mask;
+    int mw = m->width, mh = m->height;
+    snprintf(name, sizeof(name), "%s/bin%06d.png", w->out, it->frame);
+    m->width = it->orig.width;
+    m->height = it->orig.height;
+    cvSaveImage(name, m, 0);
+    m->width = mw;
+    m->height = mh;
+}
+
+static void *write_thr(void *arg)
+{
+    writer *w = (writer*)arg;
+    writer_item it;
+    for (;;) {
+        pthread_mutex_lock(&w->lock);
+        while (!w->count && !w->quit) pthread_cond_wait(&w->more, &w->lock);
+        if (!w->count) {
+            pthread_mutex_unlock(&w->lock);
+            break;
+        }
+        it = w->queue[w->head];
+        pthread_mutex_unlock(&w->lock);
+
+        if (w->mode == WRITER_PNG) write_png(w, &it);
+        else write_file(w, &it);
+
+        // only now does the slot open up, so at most depth masks wait
+        pthread_mutex_lock(&w->lock);
+        w->head = (w->head + 1) % w->depth;
+        w->count--;
+        w->pool[w->nb_pool++] = it.mask;
+        pthread_cond_broadcast(&w->less);
+        pthread_mutex_unlock(&w->lock);
+    }
+    return NULL;
+}
+
+void writer_new(writer *w, char *out, int mode, int depth)
+{
+    memset(w, 0, sizeof(*w));
+    w->out = out;
+    w->mode = mode;
+    w->depth = depth > 0 ? depth : 1;
+    w->queue = malloc(w->depth*sizeof(writer_item));
+    w->pool = malloc(w->depth*sizeof(IplImage*));
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->more, NULL);
+    pthread_cond_init(&w->less, NULL);
+    if (pthread_create(&w->thr, NULL, write_thr, w)) {
+        fprintf(stderr, "writer: unable to create thread\n");
+        exit(1);
+    }
+}
+
+IplImage *writer_put(writer *w, IplImage *mask, CvSize orig, int frame)
+{
+    IplImage *ret = NULL;
+    writer_item *it;
+    pthread_mutex_lock(&w->lock);
+    while (w->count == w->depth) pthread_cond_wait(&w->less, &w->lock);
+    it = &w->queue[(w->head + w->count) % w->depth];
+    it->mask = mask;
+    it->orig = orig;
+    it->frame = frame;
+    w->count++;
+    pthread_cond_signal(&w->more);
+    while (w->nb_pool && !ret) {
+        IplImage *p = w->pool[--w->nb_pool];
+        if (p->width == mask->width && p->height == mask->height &&
+            p->depth == mask->depth && p->nChannels == mask->nChannels) {
+            ret = p;
+        } else cvReleaseImage(&p);
+    }
+    pthread_mutex_unlock(&w->lock);
+    if (!ret) {
+        ret = cvCreateImage(cvGetSize(mask), mask->depth, mask->nChannels);
+    }
+    return ret;
+}
+
+void writer_free(writer *w)
+{
+    pthread_mutex_lock(&w->lock);
+    w->quit = 1;
+    pthread_cond_signal(&w->more);
+    pthread_mutex_unlock(&w->lock);
+    pthread_join(w->thr, NULL);
+    while (w->nb_pool) cvReleaseImage(&w->pool[--w->nb_pool]);
+    if (w->mf_open) maskfile_close(&w->mf);
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->more);
+    pthread_cond_destroy(&w->less);
+    free(w->queue);
+    free(w->pool);
+    memset(w, 0, sizeof(*w));
+}
@@ -0,0 +1,43 @@
+#ifndef JOSH_WRITER_H
+#define JOSH_WRITER_H
+
+#include <pthread.h>
+
+#include "maskfile.h"
+
+// Writes 8 bit masks on a background thread, in the order they are
+// put. Masks go out either as out/bin%06d.png or, cropped to their
+// original size, into the single maskfile out, stored raw or run
+// length coded.
+
+enum { WRITER_PNG, WRITER_RAW, WRITER_RLE };
+
+typedef struct writer_item {
+    IplImage *mask;
+    CvSize orig;
+    int frame;
+} writer_item;
+
+typedef struct writer {
+    char *out;
+    int mode;
+    maskfile mf;
+    int mf_open;
+    int depth, head, count;
+    writer_item *queue;
+    IplImage **pool;  // written masks, ready for reuse
+    int nb_pool;
+    int quit;
+    pthread_t thr;
+    pthread_mutex_t lock;
+    pthread_cond_t more, less;
+} writer;
+
+void writer_new(writer *w, char *out, int mode, int depth);
+// Queues mask and returns a free buffer of the same kind to carry on
+// with; blocks while depth masks are already waiting.
+IplImage *writer_put(writer *w, IplImage *mask, CvSize orig, int frame);
+// Flushes everything queued.
+void writer_free(writer *w);
+
+#endif /* JOSH_WRITER_H */